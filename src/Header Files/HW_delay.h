@@ -10,7 +10,15 @@
 
 #include "em_timer.h"
 #include "em_cmu.h"
+#include "scheduler.h"
+#include "sleep_routines.h"
+
+#define DELAY_EVENT_TIMER   TIMER1  //TIMER0 is left to timer_delay()
+#define DELAY_EVENT_EM      EM2     //TIMER1 only runs down to EM1
 
 void timer_delay(uint32_t ms_delay);
+void timer_delay_event(uint32_t ms_delay, uint32_t callback);
+void cycle_counter_open(void);
+void TIMER1_IRQHandler(void);
 
 #endif /* SRC_HW_DELAY_H_ */
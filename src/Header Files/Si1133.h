@@ -40,11 +40,18 @@
 #define INPUT0_WRITE      0b1
 #define CHAN_LIST         0x1
 #define FORCE             0x11
+#define RESET_CMD_CTR     0x00    //clears CMD_ERR and the command counter
 
 #define ONE               1
 #define TWO               2
 
 #define   DIVISOR         16
+#define SI1133_CONFIG_READS 3   //RESPONSE0 reads in Si1133_configure()
+
+#define CMD_ERR           0x10    //RESPONSE0 bit set when a command failed
+#define SI1133_BURST_REG    RESPONSE0_REG   //RESPONSE0, IRQ_STATUS, HOSTOUT0..
+#define SI1133_BURST_BYTES  (HOSTOUT0_REG - RESPONSE0_REG + HOSTOUT0_BYTES)
+#define SI1133_HOSTOUT0_INDEX (HOSTOUT0_REG - RESPONSE0_REG)
 
 //***********************************************************************************
 // global variables
@@ -53,10 +60,11 @@
 //***********************************************************************************
 // function prototypes
 //***********************************************************************************
-void Si1133_i2c_open(void);
+void Si1133_i2c_open(uint32_t error_cb, uint32_t recover_cb);
 void Si1133_read(uint32_t callback, uint32_t register_addresss, uint32_t bytes);
 void Si1133_write(uint32_t callback, uint32_t register_address, uint32_t bytes, uint32_t write_data);
 uint32_t Si1133_get_read_result(void);
+bool Si1133_get_sample_valid(void);
 void Si1133_force_cmd(void);
 void Si1133_request(uint32_t callback);
 
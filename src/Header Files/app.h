@@ -20,6 +20,10 @@
 #include "LEDs_thunderboard.h"
 #include "Si1133.h"
 #include "icm20648.h"
+#include "tilt.h"
+#include "decimate.h"
+#include "gesture.h"
+#include "power_policy.h"
 #include "ble.h"
 #include "HW_delay.h"
 #include <stdio.h>
@@ -41,6 +45,21 @@
 #define TX_EVENT_CB           0x00000040 //0b0100_0000
 #define BLE_TX_DONE_CB        0x00000080 //0b1000_0000
 #define ICM20648_READ_CB      0x00000100
+#define ICM20648_STREAM_CB    0x00000200
+#define ICM20648_FIFO_COUNT_CB 0x00000400
+#define ICM20648_FIFO_DRAIN_CB 0x00000800
+#define ICM20648_MOTION_CB    0x00001000
+#define ICM20648_INIT_CB      0x00002000
+#define ICM20648_READY_CB     0x00004000
+#define ICM20648_DRDY_CB      0x00008000
+#define ICM20648_SAMPLE_CB    0x00010000
+#define GESTURE_TAP_CB        0x00020000
+#define GESTURE_STEP_CB       0x00040000
+#define GESTURE_SHAKE_CB      0x00080000
+#define POWER_MODE_CB         0x00100000
+#define SI1133_ERROR_CB       0x00200000
+#define SI1133_RECOVER_CB     0x00400000
+#define ICM20648_ERROR_CB     0x00800000
 
 #define EXPECTED_RESULTS       20
 
@@ -51,13 +70,33 @@
 #define ACCEL_ZOUT_L_REG       0x32
 #define ACCEL_ZOUT_BYTES       2
 
-#define UPSIDEDOWN_VALUE       0
+#define ACCEL_XYZ_BYTES        6
+#define TILT_HYSTERESIS_DEG    20 //degrees past 90 before face up / face down flips
+
+#define ICM_STREAM_SAMPLES     8  //LETIMER0 periods between stream callbacks
+#define ICM_WOM_ENABLED           //the ICM is only read after it signals motion
+//#define ICM_STREAM_ENABLED      //LDMA reads the ICM, costs EM1 between samples
+//#define ICM_FIFO_ENABLED        //the ICM FIFO is drained and searched for gestures each LETIMER0 period
+//#define ICM_DRDY_ENABLED        //the ICM is read every time it has a new sample
+#define ICM_DRDY_ODR           10 //Hz
+#define ICM_DECIMATE_FACTOR    4  //FIFO frames per frame used by the app
+#define ICM_FIFO_ODR           100 //Hz, fast enough to see a tap
+//#define ICM_POLICY_ENABLED      //power mode follows activity, needs ICM_FIFO_ENABLED
+#define ICM_LP_ODR             25  //Hz in ICM_POWER_LOW
+#define ICM_SLEEP_PERIOD       8   //LETIMER0 period in seconds for each power mode
+#define ICM_LP_PERIOD          PWM_PER
+#define ICM_LN_PERIOD          1
+#define ICM_QUIET_PERIODS      5   //quiet periods before moving down a power mode
+#define GESTURE_STEP_THRESHOLD  4000  //accel counts, 16384 is 1 g at +/-2 g
+#define GESTURE_TAP_THRESHOLD   12000
+#define GESTURE_SHAKE_THRESHOLD 12000
 
 #define SYSTEM_BLOCK_EM        EM3
 
 #define DELAY_2                2000
 #define ARRAYSIZE              64
 //#define BLE_TEST_ENABLED
+//#define BLE_RAW_ENABLED         //periodic readings are sent, not only events
 
 //***********************************************************************************
 // global variables
@@ -74,6 +113,20 @@ void scheduled_letimer0_comp1_cb (void);
 void scheduled_letimer0_uf_cb (void);
 void schedule_si1133_light_read_cb(void);
 void scheduled_boot_up_cb(void);
+void scheduled_icm20648_ready_cb(void);
 void scheduled_icm20648_read_cb(void);
+void scheduled_icm20648_stream_cb(void);
+void scheduled_icm20648_motion_cb(void);
+void scheduled_icm20648_drdy_cb(void);
+void scheduled_icm20648_sample_cb(void);
+void scheduled_icm20648_fifo_count_cb(void);
+void scheduled_icm20648_fifo_drain_cb(void);
+void scheduled_gesture_tap_cb(void);
+void scheduled_gesture_step_cb(void);
+void scheduled_gesture_shake_cb(void);
+void scheduled_power_mode_cb(void);
+void scheduled_si1133_error_cb(void);
+void scheduled_si1133_recover_cb(void);
+void scheduled_icm20648_error_cb(void);
 
 #endif
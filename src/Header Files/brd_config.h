@@ -72,6 +72,10 @@
 #define SI1133_SENSOR_EN_PIN  9
 #define SCL_ROUTE             I2C_ROUTELOC0_SCLLOC_LOC17
 #define SDA_ROUTE             I2C_ROUTELOC0_SDALOC_LOC17
+#define SI1133_LDMA_ENABLE    true
+#define SI1133_LDMA_TX_CH     2
+#define SI1133_LDMA_RX_CH     3
+#define SI1133_I2C_RETRIES    3
 
 //LEUART TX/RX PINS
 #define LEUART_TX_PORT          gpioPortF
@@ -95,6 +99,9 @@
 #define USART_ICM_EN_PORT      gpioPortF
 #define USART_ICM_EN_PIN       8
 
+#define ICM_INT_PORT           gpioPortF
+#define ICM_INT_PIN            12      //even pin, GPIO_EVEN_IRQHandler
+
 #define USART_TX_PORT          gpioPortC
 #define USART_TX_PIN           0
 #define USART_TX_ROUTE         USART_ROUTELOC0_TXLOC_LOC18
@@ -116,6 +123,7 @@
 #define ICM_ENABLE            usartEnable
 #define ICM_REFFREQ           0 //SETS TO DEFAULT
 #define ICM_BAUDRATE          2000000
+#define ICM_READ_BAUDRATE     7000000 //sensor and FIFO reads
 #define ICM_DATABITS          usartDatabits8
 #define ICM_MASTER            true
 #define ICM_MSBF              true
@@ -123,9 +131,15 @@
 #define ICM_PRSRXENABLE       false
 #define ICM_PRSRXCH           USART_TRIGCTRL_TSEL_PRSCH0 //NOT USED
 #define ICM_AUTOTX            false
-#define ICM_AUTOCSENABLE      false
+#define ICM_AUTOCSENABLE      ICM_LDMA_ENABLE //AUTOCS is only gap-free with the LDMA
 #define ICM_AUTOCSHOLD        2
 #define ICM_AUTOCSSETUP       2
+#define ICM_DOUBLE_BUFFER     true
+#define ICM_LDMA_ENABLE       true
+#define ICM_LDMA_TX_CH        0
+#define ICM_LDMA_RX_CH        1
+#define ICM_STREAM_PRS_CH     0 //LETIMER0 starts stream reads on this channel
+#define ICM_POLL_MAX_BYTES    2 //bank selects and WHO_AM_I are polled
 
 
 //***********************************************************************************
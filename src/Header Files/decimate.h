@@ -0,0 +1,51 @@
+#ifndef HEADER_FILES_DECIMATE_H_
+#define HEADER_FILES_DECIMATE_H_
+
+//***********************************************************************************
+// include files
+//***********************************************************************************
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "em_device.h"
+#include "em_assert.h"
+#include "HW_delay.h"
+
+//***********************************************************************************
+// defined files
+//***********************************************************************************
+#define DECIMATE_MAX_TAPS     32      //even, taps are multiplied in pairs
+#define DECIMATE_AXES         3
+#define DECIMATE_MAX_FACTOR   64
+#ifndef DECIMATE_STATS_ENABLE
+#define DECIMATE_STATS_ENABLE 0       //1 times decimate_process() with the DWT cycle counter
+#endif
+
+//***********************************************************************************
+// global variables
+//***********************************************************************************
+typedef struct {
+  uint32_t  numTaps;        //even, an odd filter gets a zero tap in front
+  uint32_t  factor;         //input frames per output frame
+  uint32_t  phase;          //input frames since the last output frame
+  uint32_t  pos;            //oldest sample of the delay line window
+  int16_t   taps[DECIMATE_MAX_TAPS];  //Q15, reversed so they line up with the window
+  int16_t   history[DECIMATE_AXES][2 * DECIMATE_MAX_TAPS];  //every sample is kept twice
+#if DECIMATE_STATS_ENABLE
+  uint32_t  cycles;
+  uint32_t  frames;
+#endif
+} DECIMATE_STATE;
+
+//***********************************************************************************
+// function prototypes
+//***********************************************************************************
+void decimate_open(DECIMATE_STATE *dec, const int16_t *taps, uint32_t num_taps,
+    uint32_t factor);
+uint32_t decimate_process(DECIMATE_STATE *dec, const int16_t (*in)[DECIMATE_AXES],
+    uint32_t frames, int16_t (*out)[DECIMATE_AXES]);
+#if DECIMATE_STATS_ENABLE
+uint32_t decimate_cycles_per_frame(const DECIMATE_STATE *dec);
+#endif
+
+#endif /* HEADER_FILES_DECIMATE_H_ */
@@ -0,0 +1,52 @@
+#ifndef HEADER_FILES_GESTURE_H_
+#define HEADER_FILES_GESTURE_H_
+
+//***********************************************************************************
+// include files
+//***********************************************************************************
+#include <stdint.h>
+#include <stdbool.h>
+#include "em_assert.h"
+#include "scheduler.h"
+
+//***********************************************************************************
+// defined files
+//***********************************************************************************
+#define GESTURE_AXES        3
+#define GESTURE_MEAN_SHIFT  5       //gravity is tracked over about 32 frames
+
+//***********************************************************************************
+// global variables
+//***********************************************************************************
+//thresholds are in accel counts of |X| + |Y| + |Z| with gravity removed,
+//times are in frames so they scale with the rate the ICM is run at
+typedef struct {
+  uint32_t  step_threshold;     //smallest peak that counts for anything
+  uint32_t  tap_threshold;
+  uint32_t  shake_threshold;
+  uint32_t  tap_max_frames;     //a tap peak is shorter than this
+  uint32_t  tap_quiet_frames;   //no other peak this long after a tap
+  uint32_t  step_min_frames;    //shortest time from one step to the next
+  uint32_t  shake_peaks;        //shake peaks needed inside shake_window_frames
+  uint32_t  shake_window_frames;
+  uint32_t  tap_cb;
+  uint32_t  step_cb;
+  uint32_t  shake_cb;
+} GESTURE_OPEN_STRUCT;
+
+typedef struct {
+  uint32_t  taps;
+  uint32_t  steps;
+  uint32_t  shakes;
+} GESTURE_COUNTS;
+
+//***********************************************************************************
+// function prototypes
+//***********************************************************************************
+void gesture_open(const GESTURE_OPEN_STRUCT *gesture_open_struct);
+void gesture_set_config(const GESTURE_OPEN_STRUCT *gesture_open_struct);
+void gesture_process(const int16_t (*frames)[GESTURE_AXES], uint32_t count);
+void gesture_get_counts(GESTURE_COUNTS *counts);
+uint32_t gesture_take_activity(void);
+
+#endif /* HEADER_FILES_GESTURE_H_ */
@@ -14,10 +14,12 @@
 
 /* The developer's include statements */
 #include "brd_config.h"
+#include "scheduler.h"
 
 //***********************************************************************************
 // defined files
 //***********************************************************************************
+#define GPIO_EVEN_INTS    0x55555555    //external interrupts routed to GPIO_EVEN_IRQn
 
 //***********************************************************************************
 // global variables
@@ -28,5 +30,7 @@
 // function prototypes
 //***********************************************************************************
 void gpio_open(void);
+void gpio_icm_int_open(uint32_t callback);
+void GPIO_EVEN_IRQHandler(void);
 
 #endif
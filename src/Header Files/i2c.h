@@ -6,13 +6,23 @@
 //***********************************************************************************
 #include "em_i2c.h"
 #include "em_cmu.h"
+#include "em_gpio.h"
 #include "sleep_routines.h"
 #include "scheduler.h"
+#include "ldma.h"
 
 //***********************************************************************************
 // defined files
 //***********************************************************************************
 #define MASK    0xFF
+#define I2C_WORD_BYTES      4       //payload bytes packed in storeData / write_data
+#define I2C_LDMA_MAX_BYTES  2048    //largest LDMA descriptor
+#define I2C_LDMA_MIN_READ   3       //the last two bytes of a read are ACKed and NACKed by the CPU
+#define I2C_QUEUE_DEPTH     8       //transfers that can wait behind the active one
+#define I2C_RESET_TIMEOUT   10000   //polls of MSTOP in i2c_bus_reset(), about 1 ms
+#define I2C_RECOVERY_CLOCKS 9       //SCL pulses that free a slave holding SDA low
+#define I2C_RECOVERY_DELAY  100     //loops per half SCL period while freeing the bus, 10-25 us
+#define I2C_ERROR_FLAGS     (I2C_IF_NACK | I2C_IF_ARBLOST | I2C_IF_BUSERR | I2C_IF_CLTO)
 
 //***********************************************************************************
 // global variables
@@ -27,8 +37,42 @@ typedef struct {
   uint32_t              out_pin_route_sda;   // out 1 route to gpio port/pin
   bool                  out_pin_scl_en;   // enable out 0 route
   bool                  out_pin_sda_en;   // enable out 1 route
+  bool                  ldma_en;          // payload bytes moved by the LDMA
+  uint32_t              ldma_tx_ch;
+  uint32_t              ldma_rx_ch;
+  GPIO_Port_TypeDef     scl_port;         // driven by hand to free a stuck bus
+  uint32_t              scl_pin;
+  GPIO_Port_TypeDef     sda_port;
+  uint32_t              sda_pin;
+  uint32_t              retries;          // tries after the first before a transfer fails
+  uint32_t              error_cb;         // scheduler event when a transfer fails
+  uint32_t              recover_cb;       // scheduler event that must call i2c_recover()
 } I2C_OPEN_STRUCT;
 
+typedef enum {
+  I2C_OK,
+  I2C_ERR_NACK,         //the slave did not ACK its address or a byte
+  I2C_ERR_ARBLOST,      //another master or a glitch took the bus
+  I2C_ERR_BUSERR,       //START or STOP in the middle of a byte
+  I2C_ERR_TIMEOUT,      //SCL held low, or the transfer did not end before i2c_watchdog()
+  I2C_ERR_BUSY,         //the bus was not idle when the transfer was started
+} I2C_ERROR;
+
+typedef void (*I2C_DONE_CB)(void *context, I2C_ERROR error);
+
+typedef struct {
+  bool            readTrue;      //0=write 1=read
+  uint32_t        deviceAddress;
+  uint32_t        registerAddress;
+  uint8_t         *buf;          //NULL to move wordBuf
+  uint32_t        bytes;
+  uint32_t        callback;      //scheduler event once the stop is sent, not sent on an error
+  I2C_DONE_CB     done;          //called from the I2C interrupt once the transfer ends, or NULL
+  void            *context;      //passed to done
+  uint32_t        *storeData;    //only set by i2c_start(), reads are packed here once done
+  uint8_t         wordBuf[I2C_WORD_BYTES];
+} I2C_TRANSACTION;
+
 typedef enum {
   initialize,
   send_RA,
@@ -46,9 +90,38 @@ typedef struct {
   uint32_t        numOfBytes;
   uint32_t        deviceAddress;
   uint32_t        registerAddress;
-  uint32_t        callback;
-  uint32_t        *storeData;
-  uint32_t        writeData;
+  uint8_t         *buf;          //payload, read into or written from
+  uint32_t        index;         //next byte of buf
+  uint32_t        totalBytes;
+
+  I2C_TRANSACTION queue[I2C_QUEUE_DEPTH];   //queue[queueHead] is the active transfer
+  uint32_t        queueHead;
+  volatile uint32_t queueCount;
+  uint32_t        queueHighWater;
+
+  GPIO_Port_TypeDef sclPort;
+  uint32_t        sclPin;
+  GPIO_Port_TypeDef sdaPort;
+  uint32_t        sdaPin;
+  uint32_t        retries;
+  uint32_t        retriesLeft;   //of the transfer at the head of the queue
+  uint32_t        errorCb;
+  uint32_t        recoverCb;
+  volatile bool   faultTrue;     //waiting on i2c_recover()
+  I2C_ERROR       faultError;
+  uint32_t        transferCount; //transfers started, read by i2c_watchdog()
+  uint32_t        watchdogCount;
+  I2C_ERROR       lastError;
+  uint32_t        errorCount;    //transfers that failed after all retries
+  uint32_t        recoveryCount; //bus recoveries, one per fault
+
+  bool            ldmaTrue;      //opened with an LDMA channel pair
+  bool            ldmaActive;    //the LDMA moves the payload of this transfer
+  uint32_t        ldmaTxCh;
+  uint32_t        ldmaRxCh;
+  LDMA_PeripheralSignal_t ldmaTxSignal;
+  LDMA_PeripheralSignal_t ldmaRxSignal;
+  LDMA_Descriptor_t ldmaDesc[2];  //[0] payload, [1] AUTOACK off after a read
 
   volatile bool   busy;
 } I2C_STATE_MACHINE;
@@ -60,11 +133,20 @@ void i2c_open(I2C_TypeDef *i2c, I2C_OPEN_STRUCT *i2c_setup);
 void i2c_start(I2C_TypeDef *i2c, bool readTrue, uint32_t bytes, uint32_t deviceAddress,
                uint32_t registerAddress, uint32_t callback, uint32_t *storeData,
                uint32_t write_data);
+void i2c_transfer(I2C_TypeDef *i2c, bool readTrue, uint32_t deviceAddress,
+                  uint32_t registerAddress, uint8_t *buf, uint32_t bytes,
+                  uint32_t callback);
+void i2c_enqueue(I2C_TypeDef *i2c, const I2C_TRANSACTION *transaction);
 void I2C0_IRQHandler(void);
 void I2C1_IRQHandler(void);
 void i2c_ack_sm(I2C_STATE_MACHINE *i2c_sm);
 void i2c_read_sm(I2C_STATE_MACHINE *i2c_sm);
 void i2c_stop_sm(I2C_STATE_MACHINE *i2c_sm);
+void i2c_ldma_done_sm(void *context);
 bool get_i2c_busy(I2C_TypeDef *i2c);
+uint32_t i2c_queue_high_water(I2C_TypeDef *i2c);
+void i2c_watchdog(I2C_TypeDef *i2c);
+void i2c_recover(I2C_TypeDef *i2c);
+I2C_ERROR i2c_get_last_error(I2C_TypeDef *i2c, uint32_t *errorCount, uint32_t *recoveryCount);
 
 #endif /* HEADER_FILES_I2C_H_ */
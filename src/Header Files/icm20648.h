@@ -4,6 +4,7 @@
 //***********************************************************************************
 // include files
 //***********************************************************************************
+#include <string.h>
 #include "HW_delay.h"
 #include "em_assert.h"
 #include "spi.h"
@@ -17,33 +18,151 @@
 #define PWR_MGMT_1_REG      0x06    //bank 0
 #define PWR_MGMT_1_BYTES    1
 #define PWR_MGMT_1_DATA     0b00101000
+#define PWR_MGMT_1_DEVICE_RESET 0b10000000  //self clearing, every register goes back to reset
+#define PWR_MGMT_1_SLEEP    0b01000000
+#define PWR_MGMT_1_LP_EN    0b00100000
+#define PWR_MGMT_1_TEMP_DIS 0b00001000
+#define PWR_MGMT_1_CLK_AUTO 0b00000001  //PLL once the gyro is running
 #define PWR_MGMT_2_REG      0x07    //bank 0
 #define PWR_MGMT_2_BYTES    1
 #define PWR_MGMT_2_DATA     0b000111
+#define PWR_MGMT_2_ALL_ON   0b000000
+#define PWR_MGMT_2_ALL_OFF  0b111111
 #define LP_CONFIG_REG       0x05    //bank 0
 #define LP_CONFIG_BYTES     1
 #define LP_CONFIG_DATA      0b00100000
+#define LP_CONFIG_NONE      0b00000000  //accel and gyro run continuously
 #define ACCEL_WOM_THR_REG   0x13    //bank 2
 #define ACCEL_WOM_THR_BYTES 1
 #define ACCEL_WOM_THR_DATA  60
+#define INT_PIN_CFG_REG     0x0F    //bank 0
+#define INT_PIN_CFG_DATA    0b00110000  //active high push-pull, latched, any read clears
+#define INT_ENABLE_REG      0x10    //bank 0
+#define INT_ENABLE_WOM      0b00001000
+#define INT_ENABLE_1_REG    0x11    //bank 0
+#define INT_ENABLE_1_RDY    0b00000001  //raw data ready on INT
+#define INT_STATUS_REG      0x19    //bank 0
+#define ACCEL_SMPLRT_DIV_1_REG 0x10 //bank 2, bits 11:8 of the divider
+#define ACCEL_SMPLRT_DIV_2_REG 0x11 //bank 2, bits 7:0 of the divider
+#define ACCEL_SMPLRT_DIV_MAX  4095
+#define ACCEL_BASE_ODR        1125  //Hz, ODR = 1125 / (1 + divider)
+#define GYRO_SMPLRT_DIV_REG   0x00  //bank 2
+#define GYRO_SMPLRT_DIV_MAX   255
+#define GYRO_BASE_ODR         1100  //Hz, ODR = 1100 / (1 + divider)
+#define ACCEL_CONFIG_REG      0x14  //bank 2
+#define ACCEL_FCHOICE         0x01  //DLPF used
+#define ACCEL_FS_SEL_SHIFT    1
+#define ACCEL_DLPFCFG_SHIFT   3
+#define ACCEL_DLPFCFG_MAX     7
+#define ICM_DLPF_OFF          0xFF  //DLPF bypassed
+#define ACCEL_INTEL_CTRL_REG  0x12  //bank 2
+#define ACCEL_INTEL_CTRL_DATA 0b11  //WOM on, compared with the previous sample
 #define REG_BANK_SEL_REG    0x7F
 #define REG_BANK_SEL_BYTES  1
 #define REG_BANK_0_DATA     0b000000
 #define REG_BANK_2_DATA     0b100000
+#define REG_BANK_SHIFT      4
+#define ICM_NUM_BANKS       4
+#define ICM_NUM_REGS        128     //7 bit register address
+#define ICM_BANK_UNKNOWN    0xFF    //REG_BANK_SEL is not known until written
+//#define ICM_VERIFY_WRITES         //read back every bring-up write
+
+#define ACCEL_XOUT_H_REG    0x2D    //bank 0, through TEMP_OUT_L 0x3A
+#define ICM_SAMPLE_BYTES    14      //accel X Y Z, gyro X Y Z, temp, high byte first
+#define USER_CTRL_REG       0x03    //bank 0
+#define USER_CTRL_FIFO_EN   0x40
+#define FIFO_EN_2_REG       0x67    //bank 0
+#define FIFO_EN_2_ACCEL     0x10
+#define FIFO_RST_REG        0x68    //bank 0, strobe, never shadowed
+#define FIFO_RST_ALL        0x1F
+#define FIFO_RST_NONE       0x00
+#define FIFO_MODE_REG       0x69    //bank 0
+#define FIFO_MODE_STREAM    0x00    //oldest data is overwritten when full
+#define FIFO_COUNTH_REG     0x70    //bank 0, FIFO_COUNTL follows
+#define FIFO_COUNT_BYTES    2
+#define FIFO_COUNT_MASK     0x1FFF
+#define FIFO_R_W_REG        0x72    //bank 0
+
+#define ICM_FIFO_FRAME_BYTES  6     //accel X, Y, Z, high byte first
+#define ICM_FIFO_WATERMARK    32    //frames in the FIFO before it is drained
+#define ICM_FIFO_RING_FRAMES  64    //frames kept until icm20648_fifo_pop()
 
 #define ICM_DA              0xE0
-#define ICM_WRITE_DELAY     22
+#define ICM_RETRY_DELAY     1       //ms between WHO_AM_I reads during power up
+#define ICM_STARTUP_RETRIES 100     //register access is ready within 100 ms
 #define NOP                 0
 
 //***********************************************************************************
 // global variables
 //***********************************************************************************
+typedef enum {
+  ICM_STEP_CHECK,       //read a register and compare it to data
+  ICM_STEP_WRITE,       //write data to a register
+  ICM_STEP_BANK,        //select a register bank
+  ICM_STEP_END,
+} ICM_STEP_OP;
+
+typedef struct {
+  ICM_STEP_OP   op;
+  uint8_t       bank;
+  uint8_t       reg;
+  uint8_t       data;
+} ICM_INIT_STEP;
+
+typedef enum {
+  ICM_POWER_SLEEP,      //accel and gyro off, registers kept
+  ICM_POWER_LOW,        //accel duty cycled, gyro off
+  ICM_POWER_LOW_NOISE,  //accel and gyro running continuously
+  ICM_POWER_MODES,
+} ICM_POWER_MODE;
+
+typedef enum {
+  ICM_ACCEL_2G,
+  ICM_ACCEL_4G,
+  ICM_ACCEL_8G,
+  ICM_ACCEL_16G,
+} ICM_ACCEL_RANGE;
+
+//same order as the registers from ACCEL_XOUT_H, so a burst can land in it
+typedef struct {
+  int16_t   accel[3];     //X, Y, Z
+  int16_t   gyro[3];      //X, Y, Z
+  int16_t   temp;
+} icm20648_sample_t;
 
 //***********************************************************************************
 // function prototypes
 //***********************************************************************************
-void icm20648_open(void);
+void icm20648_open(uint32_t step_cb, uint32_t ready_cb, uint32_t error_cb);
+void icm20648_init_step(void);
 void icm20648_read(uint32_t reg, uint32_t bytes, uint32_t callback);
+void icm20648_read_buffer(uint32_t reg, uint8_t *buf, uint32_t bytes, uint32_t callback);
+void icm20648_stream_start(uint32_t prs_ch, uint32_t reg, uint32_t bytes,
+    uint8_t *ring, uint32_t samples, uint32_t callback);
+void icm20648_stream_stop(void);
+const uint8_t *icm20648_stream_frames(void);
+void icm20648_select_bank(uint32_t bank);
+void icm20648_write_reg(uint32_t bank, uint32_t reg, uint8_t data, uint32_t callback);
+void icm20648_modify_reg(uint32_t bank, uint32_t reg, uint8_t mask, uint8_t data,
+    uint32_t callback);
+uint32_t icm20648_elided_count(void);
+void icm20648_wom_open(void);
+void icm20648_set_accel_odr(uint32_t hz);
+void icm20648_set_gyro_odr(uint32_t hz);
+void icm20648_set_power_mode(ICM_POWER_MODE mode);
+void icm20648_set_accel_config(ICM_ACCEL_RANGE range, uint32_t dlpf);
+void icm20648_drdy_start(void);
+void icm20648_drdy_stop(void);
+void icm20648_drdy_read(uint32_t callback);
+const icm20648_sample_t *icm20648_drdy_publish(void);
+void icm20648_read_sample(uint32_t callback);
+void icm20648_get_sample(icm20648_sample_t *sample);
+void icm20648_fifo_start(void);
+void icm20648_fifo_stop(void);
+void icm20648_fifo_poll(uint32_t callback);
+bool icm20648_fifo_drain(uint32_t callback);
+uint32_t icm20648_fifo_drained(void);
+bool icm20648_fifo_pop(int16_t accel[3]);
 void icm20648_write(uint32_t reg, uint32_t bytes, uint32_t writeData, uint32_t callback);
 uint16_t icm20648_get_read_result(void);
 
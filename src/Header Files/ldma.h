@@ -0,0 +1,35 @@
+#ifndef HEADER_FILES_LDMA_H_
+#define HEADER_FILES_LDMA_H_
+
+//***********************************************************************************
+// include files
+//***********************************************************************************
+#include "em_ldma.h"
+#include "em_cmu.h"
+#include "em_assert.h"
+
+//***********************************************************************************
+// defined files
+//***********************************************************************************
+#define LDMA_NUM_CHANNELS   8
+#define LDMA_NUM_SYNC       8       //PRS channels 0 to 7 can set a sync bit
+
+//***********************************************************************************
+// global variables
+//***********************************************************************************
+typedef void (*LDMA_CHANNEL_CB)(void *context);
+
+typedef struct {
+  LDMA_CHANNEL_CB   callback;     //driver function run when the channel is done
+  void              *context;     //driver state handed back to the callback
+} LDMA_CHANNEL_STRUCT;
+
+//***********************************************************************************
+// function prototypes
+//***********************************************************************************
+void ldma_open(void);
+void ldma_channel_open(uint32_t channel, LDMA_CHANNEL_CB callback, void *context);
+void ldma_sync_prs_enable(uint32_t prs_ch);
+void LDMA_IRQHandler(void);
+
+#endif /* HEADER_FILES_LDMA_H_ */
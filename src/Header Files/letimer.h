@@ -9,6 +9,7 @@
 
 /* Silicon Labs include statements */
 #include "em_letimer.h"
+#include "em_prs.h"
 #include "em_gpio.h"
 #include "em_cmu.h"
 #include "em_assert.h"
@@ -49,6 +50,8 @@ typedef struct {
 //***********************************************************************************
 void letimer_pwm_open(LETIMER_TypeDef *letimer, APP_LETIMER_PWM_TypeDef *app_letimer_struct);
 void letimer_start(LETIMER_TypeDef *letimer, bool enable);
+void letimer_prs_open(LETIMER_TypeDef *letimer, uint32_t prs_ch);
+void letimer_set_period(LETIMER_TypeDef *letimer, float period, float active_period);
 void LETIMER0_IRQHandler(void);
 
 #endif
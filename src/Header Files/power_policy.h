@@ -0,0 +1,41 @@
+#ifndef HEADER_FILES_POWER_POLICY_H_
+#define HEADER_FILES_POWER_POLICY_H_
+
+//***********************************************************************************
+// include files
+//***********************************************************************************
+#include <stdint.h>
+#include <stdbool.h>
+#include "em_assert.h"
+#include "scheduler.h"
+#include "icm20648.h"
+
+//***********************************************************************************
+// defined files
+//***********************************************************************************
+
+//***********************************************************************************
+// global variables
+//***********************************************************************************
+typedef struct {
+  uint32_t  odr_hz;         //accel and gyro rate, not used in ICM_POWER_SLEEP
+  float     period;         //LETIMER0 period in seconds
+} POWER_PROFILE;
+
+typedef struct {
+  POWER_PROFILE   profile[ICM_POWER_MODES];
+  ICM_POWER_MODE  start_mode;
+  uint32_t        active_threshold;   //activity in a period that moves a mode up
+  uint32_t        quiet_periods;      //quiet periods in a row that move a mode down
+  uint32_t        mode_cb;            //scheduler event when the mode changes
+} POWER_POLICY_OPEN_STRUCT;
+
+//***********************************************************************************
+// function prototypes
+//***********************************************************************************
+void power_policy_open(const POWER_POLICY_OPEN_STRUCT *power_policy_open_struct);
+void power_policy_update(uint32_t activity);
+ICM_POWER_MODE power_policy_get_mode(void);
+const POWER_PROFILE *power_policy_get_profile(void);
+
+#endif /* HEADER_FILES_POWER_POLICY_H_ */
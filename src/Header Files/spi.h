@@ -10,6 +10,8 @@
 #include "scheduler.h"
 #include "em_cmu.h"
 #include "brd_config.h"
+#include "ldma.h"
+#include "HW_delay.h"
 
 //***********************************************************************************
 // defined files
@@ -21,6 +23,18 @@
 #define GARBAGEDATA     0xFF
 #define MASK            0xFF
 #define EIGHT           8
+#define SPI_PACKED_BYTES    4       //most bytes spi_start() can pack in a uint32_t
+#define SPI_LDMA_MAX_BYTES  2048    //most bytes one LDMA descriptor can move
+#define SPI_QUEUE_DEPTH     8       //transfers that can wait behind the active one
+#define SPI_POLL_TIMEOUT    10000   //USART status polls per byte of a polled frame
+#define SPI_NUM_INSTANCES   6       //USART0 to USART5, unused ones are left empty
+#define SPI_STREAM_FRAME(bytes) ((bytes) + 1) //stream frame, address echo then data
+
+#ifndef SPI_STATS_ENABLE
+#define SPI_STATS_ENABLE    0       //1 times every transfer with the DWT cycle counter
+#endif
+#define SPI_STATS_REGISTERS 128     //one entry per 7 bit register address
+#define SPI_STATS_BUCKETS   20      //bucket n counts 2^n to 2^(n+1)-1 cycles
 
 //***********************************************************************************
 // global variables
@@ -28,7 +42,8 @@
 typedef struct {
   USART_Enable_TypeDef    enable;
   uint32_t                refFreq;
-  uint32_t                baudrate;
+  uint32_t                baudrate;       //clock of writes
+  uint32_t                read_baudrate;  //clock of reads, 0 to use baudrate
   USART_Databits_TypeDef  databits;
   bool                    master;
   bool                    msbf;
@@ -36,7 +51,7 @@ typedef struct {
   bool                    prsRxEnable;
   USART_PRS_Channel_t     prsRxCh;
   bool                    autoTx;
-  bool                    autoCsEnable;
+  bool                    autoCsEnable;   //needs ldma_en, else cs_port and cs_pin are used
   uint8_t                 autoCsHold;
   uint8_t                 autoCsSetup;
 
@@ -50,6 +65,17 @@ typedef struct {
   bool                    cs_pin_en;
   bool                    sclk_pin_en;
 
+  GPIO_Port_TypeDef       cs_port;        //chip select driven by the driver
+  uint32_t                cs_pin;         //when autoCsEnable is false
+
+  bool                    double_buffer_en; //two bytes per TXBL and RXFULL interrupt
+
+  bool                    ldma_en;        //move whole frames with LDMA
+  uint32_t                ldma_tx_ch;
+  uint32_t                ldma_rx_ch;
+
+  uint32_t                poll_max_bytes; //transfers this short are polled, 0 never
+
 } SPI_OPEN_STRUCT;
 
 typedef enum {
@@ -58,21 +84,109 @@ typedef enum {
   write,
 } DEFINED_SPI_STATES;
 
+typedef struct {
+  USART_TypeDef           *usart;
+  CMU_Clock_TypeDef       clock;
+  IRQn_Type               rxIrq;
+  IRQn_Type               txIrq;
+  LDMA_PeripheralSignal_t ldmaTxSignal;
+  LDMA_PeripheralSignal_t ldmaRxSignal;
+} SPI_INSTANCE;
+
+typedef struct {
+  bool            readTrue;
+  uint32_t        registerAddress;
+  const uint8_t   *txBuf;
+  uint8_t         *rxBuf;
+  uint32_t        bytes;
+  uint32_t        callback;
+  uint32_t        *storeData;    //only set by spi_start(), packed once when done
+  bool            packedTrue;    //txBuf and rxBuf are packBytes
+  uint8_t         packBytes[SPI_PACKED_BYTES];
+#if SPI_STATS_ENABLE
+  uint32_t        enqueueStamp;  //CYCCNT when spi_enqueue() took the transfer
+#endif
+} SPI_TRANSACTION;
+
+#if SPI_STATS_ENABLE
+typedef struct {
+  uint32_t        enqueue;
+  uint32_t        csAssert;
+  uint32_t        firstByte;
+  uint32_t        lastByte;
+  uint32_t        dispatch;
+  uint32_t        isrEntry;
+  uint32_t        isr;           //cycles spent in the USART interrupt handlers
+  uint32_t        isrCalls;      //USART interrupts taken
+  bool            isrActive;     //inside a USART interrupt handler
+} SPI_STAMPS;
+#endif
+
+typedef struct {
+  uint32_t        count;
+  uint32_t        min;           //enqueue to callback dispatch in cycles
+  uint32_t        max;
+  uint64_t        sum;           //sum / count is the mean
+  uint64_t        waitSum;       //enqueue to chip select, time spent queued
+  uint64_t        setupSum;      //chip select to first byte
+  uint64_t        transferSum;   //first byte to last byte
+  uint64_t        dispatchSum;   //last byte to callback dispatch
+  uint64_t        isrSum;        //part of the total spent in the USART ISRs
+  uint32_t        isrCallSum;    //USART interrupts taken, over byteSum per byte
+  uint32_t        byteSum;       //data bytes moved, not counting the address
+  uint32_t        histogram[SPI_STATS_BUCKETS];
+} SPI_REG_STATS;
+
 typedef struct {
   DEFINED_SPI_STATES  currentState;
 
-  USART_TypeDef     *usart;          //stores I2C0 OR I2C1 defined struct
+  USART_TypeDef     *usart;          //stores the USART0 to USART5 defined struct
+  GPIO_Port_TypeDef cs_port;
+  uint32_t          cs_pin;
+  bool              autoCsTrue;      //chip select is driven by the USART
+  bool              doubleTrue;      //TXDOUBLE and RXDOUBLE are used
+  uint32_t          clkdivWrite;     //CLKDIV worked out in spi_open() for writes
+  uint32_t          clkdivRead;      //and for reads
+  uint32_t          pollMaxBytes;
   bool            readTrue;      //0=write 1=read
   uint32_t        readCounter;
   uint32_t        writeCounter;
   //uint32_t        deviceAddress;
   uint32_t        registerAddress;
   uint32_t        callback;
-  uint32_t        *storeData;
-  uint32_t        writeData;
+  uint32_t        bytes;
+  const uint8_t   *txBuf;        //data written, GARBAGEDATA is sent on a read
+  uint8_t         *rxBuf;        //data read, ignored on a write
   bool            bitBucketTrue;
 
+  SPI_TRANSACTION queue[SPI_QUEUE_DEPTH];   //queue[queueHead] is the active transfer
+  uint32_t        queueHead;
+  volatile uint32_t queueCount;
+  uint32_t        queueHighWater;
+
+  bool                    ldmaTrue;       //frames are moved by LDMA not the ISRs
+  uint32_t                ldmaTxCh;
+  uint32_t                ldmaRxCh;
+  LDMA_PeripheralSignal_t ldmaTxSignal;
+  LDMA_PeripheralSignal_t ldmaRxSignal;
+  LDMA_Descriptor_t       ldmaTxDesc[2];  //[0] register address, [1] data
+  LDMA_Descriptor_t       ldmaRxDesc[2];  //[0] address echo, [1] data
+  uint8_t                 header;
+  uint8_t                 txDummy;
+  uint8_t                 rxDiscard;
+
+  bool                    streamTrue;       //PRS triggered sampling is running
+  uint8_t                 *streamRing;      //two halves of streamHalfBytes
+  uint32_t                streamHalfBytes;
+  uint32_t                streamNext;       //half the RX channel is filling
+  uint32_t                streamCallback;
+  LDMA_Descriptor_t       streamTxDesc[3];  //[0] PRS wait, [1] address, [2] dummy
+  LDMA_Descriptor_t       streamRxDesc[2];  //one per ring half
+
   volatile bool   busy;
+#if SPI_STATS_ENABLE
+  SPI_STAMPS      stamps;        //timestamps of the active transfer
+#endif
 } SPI_STATE_MACHINE;
 
 //***********************************************************************************
@@ -82,10 +196,49 @@ void spi_open(USART_TypeDef *spi, SPI_OPEN_STRUCT *spi_settings);
 void spi_start(USART_TypeDef *spi, bool readTrue, uint32_t bytes,
                uint32_t registerAddress, uint32_t callback, uint32_t *storeData,
                uint32_t write_data);
-void USART0_RX_IRQHandler(void);
+void spi_transfer(USART_TypeDef *usart, bool readTrue, uint32_t registerAddress,
+                  const uint8_t *txBuf, uint8_t *rxBuf, uint32_t bytes,
+                  uint32_t callback);
+uint32_t spi_queue_depth(USART_TypeDef *usart);
+bool spi_get_busy(USART_TypeDef *usart);
+uint32_t spi_queue_high_water(USART_TypeDef *usart);
+void spi_stream_start(USART_TypeDef *usart, uint32_t prs_ch, uint32_t registerAddress,
+    uint32_t bytes, uint8_t *ring, uint32_t samples, uint32_t callback);
+void spi_stream_stop(USART_TypeDef *usart);
+const uint8_t *spi_stream_frames(USART_TypeDef *usart);
+bool spi_stats_read(uint32_t registerAddress, SPI_REG_STATS *stats);
+void spi_stats_reset(void);
+void usart_rx_irq(SPI_STATE_MACHINE *spi_sm);
 void usart_rxdatav_sm(SPI_STATE_MACHINE *spi_sm);
-void USART0_TX_IRQHandler(void);
+void usart_rxfull_sm(SPI_STATE_MACHINE *spi_sm);
+void usart_tx_irq(SPI_STATE_MACHINE *spi_sm);
 void usart_txbl_sm(SPI_STATE_MACHINE *spi_sm);
 void usart_txc_sm(SPI_STATE_MACHINE *spi_sm);
+void usart_ldma_done_sm(void *context);
+
+#if defined(USART0)
+void USART0_RX_IRQHandler(void);
+void USART0_TX_IRQHandler(void);
+#endif
+#if defined(USART1)
+void USART1_RX_IRQHandler(void);
+void USART1_TX_IRQHandler(void);
+#endif
+#if defined(USART2)
+void USART2_RX_IRQHandler(void);
+void USART2_TX_IRQHandler(void);
+#endif
+#if defined(USART3)
+void USART3_RX_IRQHandler(void);
+void USART3_TX_IRQHandler(void);
+#endif
+#if defined(USART4)
+void USART4_RX_IRQHandler(void);
+void USART4_TX_IRQHandler(void);
+#endif
+#if defined(USART5)
+void USART5_RX_IRQHandler(void);
+void USART5_TX_IRQHandler(void);
+#endif
 
 #endif /* HEADER_FILES_SPI_H_ */
@@ -0,0 +1,55 @@
+#ifndef HEADER_FILES_TILT_H_
+#define HEADER_FILES_TILT_H_
+
+//***********************************************************************************
+// include files
+//***********************************************************************************
+#include <stdint.h>
+#include <stdbool.h>
+#include "em_assert.h"
+
+//***********************************************************************************
+// defined files
+//***********************************************************************************
+//angles are binary angles in Q15, 32768 is half a turn, the same bits as a q15_t
+#define TILT_HALF_TURN        32768
+#define TILT_QUARTER_TURN     16384
+#define TILT_DEG_TO_ANGLE(deg)  ((int32_t)(((int64_t)(deg) * 65536) / 360))
+#define TILT_CORDIC_STEPS     15
+#define TILT_CORDIC_SHIFT     8       //fraction bits added to the accel counts
+#define TILT_CORDIC_GAIN_INV  19898   //1 / 1.64676 in Q15
+#define TILT_GYRO_GAIN_SHIFT  24      //fraction bits of the gyro gain
+#define TILT_Q15_ONE          32768
+
+//***********************************************************************************
+// global variables
+//***********************************************************************************
+typedef enum {
+  TILT_UNKNOWN,         //no sample yet
+  TILT_FACE_UP,
+  TILT_FACE_DOWN,
+} TILT_ORIENTATION;
+
+typedef struct {
+  int16_t           pitch;        //about Y, filtered when the gyro is on
+  int16_t           roll;         //about X, filtered when the gyro is on
+  uint16_t          tilt;         //angle from +Z, 0 face up to 32768 face down
+  TILT_ORIENTATION  orientation;
+  uint16_t          faceDownAbove;  //tilt that turns the state face down
+  uint16_t          faceUpBelow;    //tilt that turns the state face up
+  bool              gyroTrue;
+  int32_t           gyroGain;     //angle per gyro count per sample, TILT_GYRO_GAIN_SHIFT
+  int32_t           accelWeight;  //Q15 weight of the accel angle in the filter
+} TILT_STATE;
+
+//***********************************************************************************
+// function prototypes
+//***********************************************************************************
+void tilt_open(TILT_STATE *tilt, uint32_t hysteresis_deg);
+void tilt_gyro_open(TILT_STATE *tilt, uint32_t lsb_per_dps, uint32_t odr_hz,
+    int32_t accel_weight);
+void tilt_gyro_close(TILT_STATE *tilt);
+bool tilt_update(TILT_STATE *tilt, const int16_t accel[3], const int16_t *gyro);
+int32_t tilt_atan2(int32_t y, int32_t x, int32_t *magnitude);
+
+#endif /* HEADER_FILES_TILT_H_ */
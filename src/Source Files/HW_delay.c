@@ -15,6 +15,8 @@
 //***********************************************************************************
 // private variables
 //***********************************************************************************
+static uint32_t delay_event_cb;
+static volatile bool delay_event_busy;
 
 
 //***********************************************************************************
@@ -49,3 +51,73 @@ void timer_delay(uint32_t ms_delay){
 	CMU_ClockEnable(cmuClock_TIMER0, false);
 }
 
+/***************************************************************************//**
+ * @brief
+ *  Adds a callback to the scheduler after a delay without waiting for it
+ *
+ * @details
+ *  Unlike timer_delay() the caller returns right away and the CPU sleeps in
+ *  EM1 until DELAY_EVENT_TIMER underflows and TIMER1_IRQHandler() posts the
+ *  callback. Only one delay can be running at a time.
+ *
+ * @param [in] ms_delay
+ *  Delay in ms, up to about 3 s at the HFPER clock
+ *
+ * @param [in] callback
+ *  Scheduler event added once the delay is over
+ *
+ ******************************************************************************/
+void timer_delay_event(uint32_t ms_delay, uint32_t callback){
+	uint32_t timer_clk_freq = CMU_ClockFreqGet(cmuClock_HFPER);
+	uint32_t delay_count = ms_delay *(timer_clk_freq/1000) / 1024;
+	EFM_ASSERT(!delay_event_busy);
+	EFM_ASSERT(delay_count <= _TIMER_CNT_CNT_MASK);
+	CMU_ClockEnable(cmuClock_TIMER1, true);
+	TIMER_Init_TypeDef delay_counter_init = TIMER_INIT_DEFAULT;
+		delay_counter_init.oneShot = true;
+		delay_counter_init.enable = false;
+		delay_counter_init.mode = timerModeDown;
+		delay_counter_init.prescale = timerPrescale1024;
+		delay_counter_init.debugRun = false;
+	TIMER_Init(DELAY_EVENT_TIMER, &delay_counter_init);
+	delay_event_cb = callback;
+	delay_event_busy = true;
+	sleep_block_mode(DELAY_EVENT_EM);
+	DELAY_EVENT_TIMER->CNT = delay_count;
+	DELAY_EVENT_TIMER->IFC = DELAY_EVENT_TIMER->IF;
+	DELAY_EVENT_TIMER->IEN = TIMER_IEN_UF;
+	NVIC_EnableIRQ(TIMER1_IRQn);
+	TIMER_Enable(DELAY_EVENT_TIMER, true);
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Ends a timer_delay_event() delay and posts its callback
+ *
+ ******************************************************************************/
+void TIMER1_IRQHandler(void){
+	DELAY_EVENT_TIMER->IFC = DELAY_EVENT_TIMER->IF;
+	DELAY_EVENT_TIMER->IEN = 0;
+	TIMER_Enable(DELAY_EVENT_TIMER, false);
+	CMU_ClockEnable(cmuClock_TIMER1, false);
+	sleep_unblock_mode(DELAY_EVENT_EM);
+	delay_event_busy = false;
+	add_scheduled_event(delay_event_cb);
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Starts the DWT cycle counter used to time code on the board
+ *
+ * @details
+ *  The trace block and the free running CYCCNT counter are turned on.
+ *  CYCCNT is not reset so other users of it are not disturbed, every time is
+ *  taken as a difference which stays right across a wrap. Safe to call from
+ *  each module that times itself.
+ *
+ ******************************************************************************/
+void cycle_counter_open(void){
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
@@ -19,11 +19,19 @@
 // private variables
 //***********************************************************************************
 uint32_t si1133_read_result;
+static uint8_t si1133_config_response[SI1133_CONFIG_READS];
+static uint8_t si1133_burst[SI1133_BURST_BYTES];
+static uint32_t si1133_cmd_ctr;       //command counter after the last command seen
+static bool si1133_sample_valid;
 
 //***********************************************************************************
 // private function prototypes
 //***********************************************************************************
 void Si1133_configure(void);
+static void Si1133_config_read(uint8_t *response, I2C_DONE_CB done);
+static void Si1133_config_done(void *context, I2C_ERROR error);
+static void Si1133_resync_done(void *context, I2C_ERROR error);
+static void Si1133_burst_done(void *context, I2C_ERROR error);
 
 //***********************************************************************************
 // private functions
@@ -35,46 +43,173 @@ void Si1133_configure(void);
  * @details
  *   Si1133_configure() configures the si1133 to measure and record the value
  *   of what light by writing to the sensor and checking to make sure the sensor
- *   has received the command.
+ *   has received the command. The whole sequence is queued at once and runs
+ *   back to back from the I2C interrupt, RESPONSE0 is read before and after
+ *   each command and the counters are checked by Si1133_config_done() once
+ *   the last read is done.
  *
  * @note
- *   This function must be called before si1133 will measure white light
+ *   This function must be called before si1133 will measure white light.
+ *   Transfers queued after it run after the configuration.
  *
  ******************************************************************************/
 void Si1133_configure(void){
-  uint32_t command_ctrl1, command_ctrl2;
-
-  Si1133_read(NO_CALLBACK, RESPONSE0_REG, RESPONSE0_BYTES);
-  while(get_i2c_busy(I2C1));
-  command_ctrl1 = (si1133_read_result)&(BIT_MASK);
+  Si1133_config_read(&si1133_config_response[0], NULL);
 
   Si1133_write(NO_CALLBACK, INPUT0_REG, INPUT0_BYTES, ADCMUX_WHITE);
-  while(get_i2c_busy(I2C1));
-
   Si1133_write(NO_CALLBACK, COMMAND_REG, COMMAND_BYTES, (PARAM_SET|ADCCONFIG0));
-  while(get_i2c_busy(I2C1));
+  Si1133_config_read(&si1133_config_response[1], NULL);
 
-  Si1133_read(NO_CALLBACK, RESPONSE0_REG, RESPONSE0_BYTES);
-  while(get_i2c_busy(I2C1));
-  command_ctrl2 = (si1133_read_result)&(BIT_MASK);
+  Si1133_write(NO_CALLBACK, INPUT0_REG, INPUT0_BYTES, INPUT0_WRITE);
+  Si1133_write(NO_CALLBACK, COMMAND_REG, COMMAND_BYTES, (PARAM_SET|CHAN_LIST));
+  Si1133_config_read(&si1133_config_response[2], Si1133_config_done);
+}
 
+/******************************************************************************
+ * @brief
+ *  Queues a read of RESPONSE0 for Si1133_configure() or a counter resync
+ *
+ * @param [in] response
+ *  Byte the RESPONSE0 value is read into
+ *
+ * @param [in] done
+ *  Called from the I2C interrupt once the read is done, or NULL
+ *
+ ******************************************************************************/
+static void Si1133_config_read(uint8_t *response, I2C_DONE_CB done){
+  I2C_TRANSACTION transaction;
+
+  transaction.readTrue = true;
+  transaction.deviceAddress = DEVICE_ADDRESS;
+  transaction.registerAddress = RESPONSE0_REG;
+  transaction.buf = response;
+  transaction.bytes = RESPONSE0_BYTES;
+  transaction.callback = NO_CALLBACK;
+  transaction.done = done;
+  transaction.context = si1133_config_response;
+  transaction.storeData = NULL;
+  i2c_enqueue(I2C1, &transaction);
+}
+
+/******************************************************************************
+ * @brief
+ *  Checks that the si1133 took both configuration commands
+ *
+ * @details
+ *  The command counter in RESPONSE0 goes up by one for each command, so the
+ *  second read must be one past the first and the third two past it. If the
+ *  last read failed the error callback reports it and there is nothing to
+ *  check, but RESPONSE0 is read again so the counter that
+ *  Si1133_burst_done() checks samples against starts from the right value.
+ *
+ * @note
+ *  Called from the I2C interrupt after the last read of Si1133_configure()
+ *
+ * @param [in] context
+ *  The RESPONSE0 values read during the configuration
+ *
+ * @param [in] error
+ *  I2C_OK if the last read worked
+ *
+ ******************************************************************************/
+static void Si1133_config_done(void *context, I2C_ERROR error){
+  uint8_t *response = context;
+  uint32_t command_ctrl1, command_ctrl2;
+
+  if(error != I2C_OK){
+      Si1133_config_read(&response[0], Si1133_resync_done);
+      return;
+  }
+
+  command_ctrl1 = response[0] & BIT_MASK;
+  si1133_cmd_ctr = response[2] & BIT_MASK;
+
+  command_ctrl2 = response[1] & BIT_MASK;
   if(!(command_ctrl1 == (command_ctrl2-ONE)%DIVISOR)){
       EFM_ASSERT(false);
   }
 
-  Si1133_write(NO_CALLBACK, INPUT0_REG, INPUT0_BYTES, INPUT0_WRITE);
-  while(get_i2c_busy(I2C1));
-  Si1133_write(NO_CALLBACK, COMMAND_REG, COMMAND_BYTES, (PARAM_SET|CHAN_LIST));
-  while(get_i2c_busy(I2C1));
-  Si1133_read(NO_CALLBACK, RESPONSE0_REG, RESPONSE0_BYTES);
-  while(get_i2c_busy(I2C1));
-
-  command_ctrl2 = (si1133_read_result)&(BIT_MASK);
+  command_ctrl2 = response[2] & BIT_MASK;
   if(!(command_ctrl1 == (command_ctrl2-TWO)%DIVISOR)){
       EFM_ASSERT(false);
   }
 }
 
+/******************************************************************************
+ * @brief
+ *  Takes the command counter from RESPONSE0 read again after a failed
+ *  configuration or a RESET_CMD_CTR
+ *
+ * @details
+ *  If this read fails as well the next sample is marked invalid and
+ *  Si1133_burst_done() takes the counter from it instead.
+ *
+ * @param [in] context
+ *  The RESPONSE0 values read during the configuration, [0] is the new one
+ *
+ * @param [in] error
+ *  I2C_OK if the read worked
+ *
+ ******************************************************************************/
+static void Si1133_resync_done(void *context, I2C_ERROR error){
+  uint8_t *response = context;
+
+  if(error == I2C_OK){
+      si1133_cmd_ctr = response[0] & BIT_MASK;
+  }
+}
+
+/******************************************************************************
+ * @brief
+ *  Takes the light sample and the command counter out of a burst read
+ *
+ * @details
+ *  The burst starts at RESPONSE0, so each sample also says whether the
+ *  force command before it was taken. The sample is only valid if the
+ *  counter moved on by one since the last command and CMD_ERR is clear,
+ *  otherwise the force write was lost or failed and HOSTOUT0 holds an old
+ *  or partial value. Without CMD_ERR the counter read is kept either way so
+ *  the next sample is judged on its own. With CMD_ERR RESPONSE0 holds an
+ *  error code instead of the counter and the si1133 ignores every command
+ *  until RESET_CMD_CTR, so the counter is left alone, RESET_CMD_CTR is
+ *  queued and RESPONSE0 is read again by Si1133_resync_done().
+ *
+ * @note
+ *  Called from the I2C interrupt when the burst of Si1133_request() is done
+ *
+ * @param [in] context
+ *  The bytes read, RESPONSE0 first
+ *
+ * @param [in] error
+ *  I2C_OK if the read worked
+ *
+ ******************************************************************************/
+static void Si1133_burst_done(void *context, I2C_ERROR error){
+  uint8_t *burst = context;
+  uint32_t command_ctr;
+
+  if(error != I2C_OK){
+      si1133_sample_valid = false;
+      return;
+  }
+
+  if(burst[0] & CMD_ERR){
+      si1133_sample_valid = false;
+      Si1133_write(NO_CALLBACK, COMMAND_REG, COMMAND_BYTES, RESET_CMD_CTR);
+      Si1133_config_read(&si1133_config_response[0], Si1133_resync_done);
+      return;
+  }
+
+  command_ctr = burst[0] & BIT_MASK;
+  si1133_sample_valid = command_ctr == (si1133_cmd_ctr + ONE) % DIVISOR;
+  si1133_cmd_ctr = command_ctr;
+
+  si1133_read_result = 0;
+  for(uint32_t i = 0; i < HOSTOUT0_BYTES; i++){
+      si1133_read_result = (si1133_read_result << 8) | burst[SI1133_HOSTOUT0_INDEX + i];
+  }
+}
+
 //***********************************************************************************
 // global functions
 //***********************************************************************************
@@ -90,8 +225,14 @@ void Si1133_configure(void){
  * @note
  *  Called in app.c when opening all other peripherals and drivers.
  *
+ * @param [in] error_cb
+ *  Scheduler event added when a transfer still fails after its retries
+ *
+ * @param [in] recover_cb
+ *  Scheduler event added after a fault, its callback must call i2c_recover()
+ *
  ******************************************************************************/
-void Si1133_i2c_open(void){
+void Si1133_i2c_open(uint32_t error_cb, uint32_t recover_cb){
    I2C_OPEN_STRUCT i2c_setup_struct;
 
    timer_delay(HARDWARE_DELAY);
@@ -105,6 +246,16 @@ void Si1133_i2c_open(void){
    i2c_setup_struct.out_pin_route_sda = SDA_ROUTE;
    i2c_setup_struct.out_pin_scl_en = true;   // enable out 0 route
    i2c_setup_struct.out_pin_sda_en = true;   // enable out 1 route
+   i2c_setup_struct.ldma_en = SI1133_LDMA_ENABLE;
+   i2c_setup_struct.ldma_tx_ch = SI1133_LDMA_TX_CH;
+   i2c_setup_struct.ldma_rx_ch = SI1133_LDMA_RX_CH;
+   i2c_setup_struct.scl_port = SI1133_SCL_PORT;
+   i2c_setup_struct.scl_pin = SI1133_SCL_PIN;
+   i2c_setup_struct.sda_port = SI1133_SDA_PORT;
+   i2c_setup_struct.sda_pin = SI1133_SDA_PIN;
+   i2c_setup_struct.retries = SI1133_I2C_RETRIES;
+   i2c_setup_struct.error_cb = error_cb;
+   i2c_setup_struct.recover_cb = recover_cb;
 
    i2c_open(I2C1, &i2c_setup_struct);
 
@@ -178,6 +329,19 @@ void Si1133_write(uint32_t callback, uint32_t register_address, uint32_t bytes,
    return Si1133_result;
  }
 
+/******************************************************************************
+* @brief
+*      Function to check the last light sample
+* @details
+*      False if the force command before the last Si1133_request() was not
+*      taken by the si1133 or the read failed, in which case the value of
+*      Si1133_get_read_result() should not be used
+*
+******************************************************************************/
+ bool Si1133_get_sample_valid(void) {
+   return si1133_sample_valid;
+ }
+
 /******************************************************************************
 * @brief
 *   Function calls the force command to the si1133 command register
@@ -200,8 +364,9 @@ void Si1133_write(uint32_t callback, uint32_t register_address, uint32_t bytes,
 *
 * @details
 *   Si1133_request() is designed to read the output of the si1133 sensor after
-*   it has been configured to measure light. This reads data from the
-*   HOSTOUT0 register in the si1133.
+*   it has been configured to measure light. One burst from RESPONSE0 through
+*   HOSTOUT0 is read after a repeated start, so the command counter is
+*   checked in the same transfer as the sample, see Si1133_burst_done().
 *
 * @note
 *   This function is called in the underflow interrupt callback function.
@@ -212,5 +377,16 @@ void Si1133_write(uint32_t callback, uint32_t register_address, uint32_t bytes,
 *
 ******************************************************************************/
  void Si1133_request(uint32_t callback){
-    Si1133_read(callback, HOSTOUT0_REG, HOSTOUT0_BYTES);
+    I2C_TRANSACTION transaction;
+
+    transaction.readTrue = true;
+    transaction.deviceAddress = DEVICE_ADDRESS;
+    transaction.registerAddress = SI1133_BURST_REG;
+    transaction.buf = si1133_burst;
+    transaction.bytes = SI1133_BURST_BYTES;
+    transaction.callback = callback;
+    transaction.done = Si1133_burst_done;
+    transaction.context = si1133_burst;
+    transaction.storeData = NULL;
+    i2c_enqueue(I2C1, &transaction);
   }
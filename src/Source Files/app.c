@@ -23,13 +23,27 @@
 static unsigned int led_color;
 static uint32_t x = 3;
 static uint32_t y = 0;
-static bool facingUpTrue;
-static bool firstZRead = true;
+static TILT_STATE app_tilt;
+#ifdef ICM_FIFO_ENABLED
+static DECIMATE_STATE app_decimate;
+static const int16_t app_decimate_taps[] = {
+    -42, -177, -406, -352, 669, 2961, 5846, 7885,
+    7885, 5846, 2961, 669, -352, -406, -177, -42
+};  //16 tap Hamming low-pass at 1/8 of the input rate, for a factor of 4
+#endif
+#ifdef ICM_STREAM_ENABLED
+static uint8_t icm_stream_ring[2 * ICM_STREAM_SAMPLES * SPI_STREAM_FRAME(ACCEL_XYZ_BYTES)];
+#endif
 
 //***********************************************************************************
 // Private functions
 //***********************************************************************************
 static void app_letimer_pwm_open(float period, float act_period, uint32_t out0_route, uint32_t out1_route);
+static void app_orientation(const int16_t accel[3]);
+static void app_gesture_config(uint32_t odr_hz, bool openTrue);
+#ifdef ICM_POLICY_ENABLED
+static void app_power_policy_open(void);
+#endif
 
 //***********************************************************************************
 // Global functions
@@ -54,11 +68,20 @@ void app_peripheral_setup(void){
   sleep_open();
   scheduler_open();
   app_led_init();
-  Si1133_i2c_open();
-  icm20648_open();
+  tilt_open(&app_tilt, TILT_HYSTERESIS_DEG);
+#ifdef ICM_FIFO_ENABLED
+  app_gesture_config(ICM_FIFO_ODR, true);
+  decimate_open(&app_decimate, app_decimate_taps,
+      sizeof(app_decimate_taps) / sizeof(app_decimate_taps[0]), ICM_DECIMATE_FACTOR);
+#endif
+  Si1133_i2c_open(SI1133_ERROR_CB, SI1133_RECOVER_CB);
+  icm20648_open(ICM20648_INIT_CB, ICM20648_READY_CB, ICM20648_ERROR_CB);
   sleep_block_mode(SYSTEM_BLOCK_EM); //WHEN SHOULD THIS BE UNBLOCKED??????????????
   ble_open(0,0); //add callback
   app_letimer_pwm_open(PWM_PER, PWM_ACT_PER, PWM_ROUTE_0, PWM_ROUTE_1);
+#ifdef ICM_STREAM_ENABLED
+  letimer_prs_open(LETIMER0, ICM_STREAM_PRS_CH);
+#endif
   add_scheduled_event(BOOT_UP_CB);
 }
 
@@ -154,14 +177,21 @@ void scheduled_letimer0_comp1_cb(void){
  *          scheduled_letimer0_uf_cb() turns off the correct led by checking
  *          the value of led_color and disabling the corresponding LED. Then it
  *          adds 1 to the led_color variable or reset the variable to 0 if at
- *          its maximum.
+ *          its maximum. The I2C1 watchdog is run once a period so a stalled
+ *          Si1133 transfer is retried instead of holding the bus.
  * @note
  *          Function is called when underflow flag of letimer0 is set.
  ******************************************************************************/
 void scheduled_letimer0_uf_cb(void){
+  i2c_watchdog(I2C1);
   Si1133_request(SI1133_LIGHT_READ_CB);
-  icm20648_read(ACCEL_ZOUT_H_REG, ACCEL_ZOUT_BYTES, ICM20648_READ_CB);
+#if defined(ICM_FIFO_ENABLED)
+  icm20648_fifo_poll(ICM20648_FIFO_COUNT_CB);
+#elif !defined(ICM_STREAM_ENABLED) && !defined(ICM_WOM_ENABLED) && !defined(ICM_DRDY_ENABLED)
+  icm20648_read_sample(ICM20648_READ_CB);
+#endif
 
+#ifdef BLE_RAW_ENABLED
   float z;
 
   x = x + 3;
@@ -173,6 +203,7 @@ void scheduled_letimer0_uf_cb(void){
   //strncat(zstring, &ch, 2);
   sprintf(zstring, "%3.1f\n", z);
   ble_write(zstring);
+#endif
 }
 
 /*******************************************************************************
@@ -188,22 +219,32 @@ void scheduled_letimer0_uf_cb(void){
  * @note
  *  Only toggles the RED and GREEN LEDs on the Mighty Gecko and indicates a correct
  *  vs. an incorrect value.
+ *  A sample the si1133 did not take the force command for is skipped.
  *
  ******************************************************************************/
  void schedule_si1133_light_read_cb(void){
    uint32_t read_result;
+   if(!Si1133_get_sample_valid()){
+       return;
+   }
    read_result = Si1133_get_read_result();
    if(read_result < EXPECTED_RESULTS){
        leds_enabled(RGB_LED_1, COLOR_BLUE, true);
+#ifdef BLE_RAW_ENABLED
        ble_write("It's dark = ");
+#endif
    } else {
        leds_enabled(RGB_LED_1, COLOR_BLUE, false);
+#ifdef BLE_RAW_ENABLED
        ble_write("It's light outside = ");
+#endif
    }
+#ifdef BLE_RAW_ENABLED
    char readString[ARRAYSIZE];
    sprintf(readString, "%lu\n", read_result);
    ble_write(readString);
    ble_write("\n");
+#endif
 
  }
 
@@ -234,41 +275,360 @@ void scheduled_letimer0_uf_cb(void){
 
  /***************************************************************************//**
   * @brief
-  *   Callback function for after the the z direction of the accelerometer has
-  *   been read
+  *   Callback for when the icm20648 bring-up sequence is done
+  *
+  * @details
+  *   Starts the way the accelerometer is read, which must wait until the
+  *   configuration writes of icm20648_open() are done.
+  *
+  ******************************************************************************/
+ void scheduled_icm20648_ready_cb(void){
+#ifdef ICM_STREAM_ENABLED
+   icm20648_stream_start(ICM_STREAM_PRS_CH, ACCEL_XOUT_H_REG, ACCEL_XYZ_BYTES,
+       icm_stream_ring, ICM_STREAM_SAMPLES, ICM20648_STREAM_CB);
+#endif
+#if defined(ICM_POLICY_ENABLED)
+   app_power_policy_open();
+   icm20648_fifo_start();
+#elif defined(ICM_FIFO_ENABLED)
+   icm20648_set_accel_odr(ICM_FIFO_ODR);
+   icm20648_fifo_start();
+#endif
+#if defined(ICM_DRDY_ENABLED)
+   icm20648_set_accel_odr(ICM_DRDY_ODR);
+   icm20648_set_accel_config(ICM_ACCEL_2G, ICM_DLPF_OFF);
+   icm20648_drdy_start();
+   gpio_icm_int_open(ICM20648_DRDY_CB);
+#elif defined(ICM_WOM_ENABLED)
+   icm20648_wom_open();
+   gpio_icm_int_open(ICM20648_MOTION_CB);
+   icm20648_read_sample(ICM20648_READ_CB);
+#endif
+ }
+
+ /***************************************************************************//**
+  * @brief
+  *   Callback function for after a sample of the accelerometer has been read
   *
   * @details
-  *   This function requests the read result from icm20648.c and converts this
-  *   value from a 16 bit unsigned integer to a short to an integer. This value
-  *   is then used to determine whether the board is upside down or right side
-  *   up. If upside down, the led 2 is changed to green and the phrase "upside
-  *   down" is sent the bluetooth device.
+  *   This function gets the decoded sample from icm20648.c and passes its
+  *   accelerometer reading to app_orientation().
   *
   ******************************************************************************/
  void scheduled_icm20648_read_cb(void){
-    uint16_t zDirection_unsigned = icm20648_get_read_result();
-    short zDirection_short = (short)zDirection_unsigned;
-    int zDirection = (int)zDirection_short;
+    icm20648_sample_t sample;
+
+    icm20648_get_sample(&sample);
+    app_orientation(sample.accel);
+  }
+
+ /***************************************************************************//**
+  * @brief
+  *   Callback function for when the LDMA has stored ICM_STREAM_SAMPLES reads
+  *   of the accelerometer
+  *
+  * @details
+  *   Only the newest read is used to determine whether the board is upside
+  *   down or right side up, the same as scheduled_icm20648_read_cb().
+  *
+  ******************************************************************************/
+ void scheduled_icm20648_stream_cb(void){
+    const uint8_t *frame = icm20648_stream_frames()
+        + (ICM_STREAM_SAMPLES - 1) * SPI_STREAM_FRAME(ACCEL_XYZ_BYTES);
+    int16_t accel[3];
+
+    for(int i = 0; i < 3; i++){
+        accel[i] = (int16_t)((frame[1 + 2 * i] << EIGHT) | frame[2 + 2 * i]);
+    }
+    app_orientation(accel);
+  }
+
+ /***************************************************************************//**
+  * @brief
+  *   Callback function for the icm20648 INT pin
+  *
+  * @details
+  *   The board has moved, so a sample is read to check the orientation. Any
+  *   register read releases the latched INT pin, so the sample read also
+  *   clears the interrupt.
+  *
+  ******************************************************************************/
+ void scheduled_icm20648_motion_cb(void){
+    icm20648_read_sample(ICM20648_READ_CB);
+  }
+
+ /***************************************************************************//**
+  * @brief
+  *   Callback function for the icm20648 data ready interrupt
+  *
+  ******************************************************************************/
+ void scheduled_icm20648_drdy_cb(void){
+    icm20648_drdy_read(ICM20648_SAMPLE_CB);
+  }
+
+ /***************************************************************************//**
+  * @brief
+  *   Callback function for after a data ready sample has been read
+  *
+  * @details
+  *   The sample is used in place in the icm20648 double buffer and passed to
+  *   app_orientation().
+  *
+  ******************************************************************************/
+ void scheduled_icm20648_sample_cb(void){
+    const icm20648_sample_t *sample = icm20648_drdy_publish();
+
+    app_orientation(sample->accel);
+  }
+
+ /***************************************************************************//**
+  * @brief
+  *   Callback function for after the icm20648 FIFO count has been read
+  *
+  * @details
+  *   Drains the FIFO if it has reached its watermark. Otherwise the drain of
+  *   this LETIMER0 period is over, so the power policy is given the activity
+  *   of the frames it drained.
+  *
+  ******************************************************************************/
+ void scheduled_icm20648_fifo_count_cb(void){
+    if(!icm20648_fifo_drain(ICM20648_FIFO_DRAIN_CB)){
+#ifdef ICM_POLICY_ENABLED
+        power_policy_update(gesture_take_activity());
+#endif
+    }
+  }
+
+ /***************************************************************************//**
+  * @brief
+  *   Callback function for after the icm20648 FIFO has been drained
+  *
+  * @details
+  *   Every drained frame is taken out of the sample ring as one block. The
+  *   full rate block is searched for gestures, then low-pass filtered and
+  *   decimated by ICM_DECIMATE_FACTOR, and the newest decimated frame is
+  *   passed to app_orientation(). The FIFO is polled again until it is below
+  *   its watermark so no frames are skipped between gesture blocks.
+  *
+  ******************************************************************************/
+ void scheduled_icm20648_fifo_drain_cb(void){
+#ifdef ICM_FIFO_ENABLED
+    int16_t block[ICM_FIFO_RING_FRAMES][DECIMATE_AXES];
+    int16_t decimated[ICM_FIFO_RING_FRAMES / ICM_DECIMATE_FACTOR + 1][DECIMATE_AXES];
+    uint32_t frames = 0;
+    uint32_t outputs;
+
+    icm20648_fifo_drained();
+    while(frames < ICM_FIFO_RING_FRAMES && icm20648_fifo_pop(block[frames])){
+        frames++;
+    }
+    gesture_process(block, frames);
+    outputs = decimate_process(&app_decimate, block, frames, decimated);
+    if(outputs){
+        app_orientation(decimated[outputs - 1]);
+    }
+    if(frames){
+        icm20648_fifo_poll(ICM20648_FIFO_COUNT_CB);
+    } else {
+#ifdef ICM_POLICY_ENABLED
+        power_policy_update(gesture_take_activity());
+#endif
+    }
+#endif
+  }
+
+ /***************************************************************************//**
+  * @brief
+  *   Updates the orientation LED and message from an accelerometer reading
+  *
+  * @details
+  *   The reading is passed to the tilt engine, which decides whether the
+  *   board is upside down or right side up from all three axes. If upside
+  *   down, the led 2 is changed to green and the phrase "upside down" is sent
+  *   the bluetooth device. Nothing is sent for a board that starts face up.
+  *
+  ******************************************************************************/
+ static void app_orientation(const int16_t accel[3]){
+    TILT_ORIENTATION previous = app_tilt.orientation;
 
-    if(firstZRead){
-        if(zDirection < UPSIDEDOWN_VALUE){
-            facingUpTrue = false;
+    if(tilt_update(&app_tilt, accel, NULL)){
+        if(app_tilt.orientation == TILT_FACE_DOWN){
             leds_enabled(RGB_LED_2, COLOR_GREEN, true);
             ble_write("Upside down\n");
-         } else if(zDirection >= UPSIDEDOWN_VALUE) {
-            facingUpTrue = true;
-         }
-        firstZRead = false;
+        } else if(previous != TILT_UNKNOWN){
+            leds_enabled(RGB_LED_2, COLOR_GREEN, false);
+            ble_write("Facing up\n");
+        }
     }
+  }
+
+ /***************************************************************************//**
+  * @brief
+  *   Callback function for a tap found by gesture.c
+  *
+  ******************************************************************************/
+ void scheduled_gesture_tap_cb(void){
+    ble_write("Tap\n");
+  }
+
+ /***************************************************************************//**
+  * @brief
+  *   Callback function for a step found by gesture.c
+  *
+  * @details
+  *   Only the running step count is sent, a few bytes per step.
+  *
+  ******************************************************************************/
+ void scheduled_gesture_step_cb(void){
+    GESTURE_COUNTS counts;
+    char stepString[ARRAYSIZE];
+
+    gesture_get_counts(&counts);
+    sprintf(stepString, "Steps %lu\n", counts.steps);
+    ble_write(stepString);
+  }
 
-    if((zDirection < UPSIDEDOWN_VALUE) && (facingUpTrue)){
-        facingUpTrue = false;
-        leds_enabled(RGB_LED_2, COLOR_GREEN, true);
-        ble_write("Upside down\n");
-    } else if((zDirection >= UPSIDEDOWN_VALUE) && !(facingUpTrue)) {
-        facingUpTrue = true;
-        leds_enabled(RGB_LED_2, COLOR_GREEN, false);
-        ble_write("Facing up\n");
+ /***************************************************************************//**
+  * @brief
+  *   Callback function for a shake found by gesture.c
+  *
+  ******************************************************************************/
+ void scheduled_gesture_shake_cb(void){
+    ble_write("Shake\n");
+  }
+
+ /***************************************************************************//**
+  * @brief
+  *   Callback function for an Si1133 transfer that failed after its retries
+  *
+  * @details
+  *   The bus has already been recovered and the transfers behind the failed
+  *   one carry on, so this only reports it. A failed light read leaves the
+  *   LED as it was until the next period.
+  *
+  ******************************************************************************/
+ void scheduled_si1133_error_cb(void){
+    uint32_t errorCount, recoveryCount;
+    I2C_ERROR error;
+    char errorString[ARRAYSIZE];
+
+    error = i2c_get_last_error(I2C1, &errorCount, &recoveryCount);
+    sprintf(errorString, "I2C error %d, %lu failed, %lu recovered\n",
+        error, errorCount, recoveryCount);
+    ble_write(errorString);
+  }
+
+ /***************************************************************************//**
+  * @brief
+  *   Callback function for a fault on the Si1133 I2C bus
+  *
+  * @details
+  *   The bus is recovered here rather than in the I2C interrupt so the
+  *   recovery does not hold off the SPI, LDMA and LETIMER0 interrupts.
+  *
+  ******************************************************************************/
+ void scheduled_si1133_recover_cb(void){
+    i2c_recover(I2C1);
+  }
+
+ /***************************************************************************//**
+  * @brief
+  *   Callback function for an icm20648 that never passed its bring-up checks
+  *
+  * @details
+  *   The bring-up has stopped and ICM20648_READY_CB will not come, so the
+  *   FIFO is never started and only the Si1133 keeps running.
+  *
+  ******************************************************************************/
+ void scheduled_icm20648_error_cb(void){
+    ble_write("ICM20648 not found\n");
+  }
+
+ /***************************************************************************//**
+  * @brief
+  *   Callback function for when the power policy picks another mode
+  *
+  * @details
+  *   The icm20648 power mode, its rate, the gesture times and the LETIMER0
+  *   period are changed together so the app always polls the FIFO at a pace
+  *   that suits the rate it is filled at.
+  *
+  ******************************************************************************/
+ void scheduled_power_mode_cb(void){
+#ifdef ICM_POLICY_ENABLED
+    ICM_POWER_MODE mode = power_policy_get_mode();
+    const POWER_PROFILE *profile = power_policy_get_profile();
+
+    icm20648_set_power_mode(mode);
+    if(mode != ICM_POWER_SLEEP){
+        icm20648_set_accel_odr(profile->odr_hz);
+        app_gesture_config(profile->odr_hz, false);
+    }
+    if(mode == ICM_POWER_LOW_NOISE){
+        icm20648_set_gyro_odr(profile->odr_hz);
     }
-    ble_write("\n");
+    letimer_set_period(LETIMER0, profile->period, PWM_ACT_PER);
+#endif
   }
+
+ /***************************************************************************//**
+  * @brief
+  *   Sets the gesture.c thresholds of this app for a frame rate
+  *
+  * @details
+  *   A tap is over within 50 ms and is followed by 250 ms without a peak,
+  *   steps are at least 300 ms apart and a shake is four large peaks within
+  *   a second.
+  *
+  * @param[in] odr_hz
+  *   Rate of the frames passed to gesture_process()
+  *
+  * @param[in] openTrue
+  *   true to open gesture.c, false to keep its counts and only change times
+  *
+  ******************************************************************************/
+ static void app_gesture_config(uint32_t odr_hz, bool openTrue){
+    GESTURE_OPEN_STRUCT gesture_open_struct;
+
+    gesture_open_struct.step_threshold = GESTURE_STEP_THRESHOLD;
+    gesture_open_struct.tap_threshold = GESTURE_TAP_THRESHOLD;
+    gesture_open_struct.shake_threshold = GESTURE_SHAKE_THRESHOLD;
+    gesture_open_struct.tap_max_frames = odr_hz / 20;
+    gesture_open_struct.tap_quiet_frames = odr_hz / 4;
+    gesture_open_struct.step_min_frames = odr_hz * 3 / 10;
+    gesture_open_struct.shake_peaks = 4;
+    gesture_open_struct.shake_window_frames = odr_hz;
+    gesture_open_struct.tap_cb = GESTURE_TAP_CB;
+    gesture_open_struct.step_cb = GESTURE_STEP_CB;
+    gesture_open_struct.shake_cb = GESTURE_SHAKE_CB;
+
+    if(openTrue){
+        gesture_open(&gesture_open_struct);
+    } else {
+        gesture_set_config(&gesture_open_struct);
+    }
+  }
+
+#ifdef ICM_POLICY_ENABLED
+ /***************************************************************************//**
+  * @brief
+  *   Opens the power policy with the profiles of this app
+  *
+  ******************************************************************************/
+ static void app_power_policy_open(void){
+    POWER_POLICY_OPEN_STRUCT policy_open_struct;
+
+    policy_open_struct.profile[ICM_POWER_SLEEP].odr_hz = ICM_LP_ODR;
+    policy_open_struct.profile[ICM_POWER_SLEEP].period = ICM_SLEEP_PERIOD;
+    policy_open_struct.profile[ICM_POWER_LOW].odr_hz = ICM_LP_ODR;
+    policy_open_struct.profile[ICM_POWER_LOW].period = ICM_LP_PERIOD;
+    policy_open_struct.profile[ICM_POWER_LOW_NOISE].odr_hz = ICM_FIFO_ODR;
+    policy_open_struct.profile[ICM_POWER_LOW_NOISE].period = ICM_LN_PERIOD;
+    policy_open_struct.start_mode = ICM_POWER_LOW;
+    policy_open_struct.active_threshold = GESTURE_STEP_THRESHOLD;
+    policy_open_struct.quiet_periods = ICM_QUIET_PERIODS;
+    policy_open_struct.mode_cb = POWER_MODE_CB;
+
+    power_policy_open(&policy_open_struct);
+  }
+#endif
@@ -0,0 +1,193 @@
+/**
+ * @file   decimate.c
+ * @brief  FIR low-pass and decimation of blocks of accelerometer frames
+ *
+ */
+//***********************************************************************************
+// Include files
+//***********************************************************************************
+#include "decimate.h"
+
+//***********************************************************************************
+// private define statements
+//***********************************************************************************
+#define DECIMATE_ROUND      (1 << 14)   //half of one Q15 count
+
+//***********************************************************************************
+// private variables
+//***********************************************************************************
+
+//***********************************************************************************
+// private function prototypes
+//***********************************************************************************
+static uint32_t decimate_pair(const int16_t *p);
+static int16_t decimate_dot(const int16_t *window, const int16_t *taps, uint32_t num_taps);
+
+//***********************************************************************************
+// private functions
+//***********************************************************************************
+/***************************************************************************//**
+ * @brief
+ *  Loads two int16_t as one word for __SMLAD
+ *
+ * @details
+ *  The delay line window starts on any halfword, and the M4 handles an
+ *  unaligned LDR, so the memcpy() compiles to a single load.
+ *
+ ******************************************************************************/
+static uint32_t decimate_pair(const int16_t *p){
+  uint32_t pair;
+
+  memcpy(&pair, p, sizeof(pair));
+  return pair;
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Q15 dot product of the delay line window with the taps
+ *
+ * @details
+ *  __SMLAD does two 16 x 16 multiplies and both adds in one cycle, so the
+ *  filter costs num_taps / 2 MACs per output. The sum is rounded and
+ *  saturated back to 16 bits.
+ *
+ ******************************************************************************/
+static int16_t decimate_dot(const int16_t *window, const int16_t *taps, uint32_t num_taps){
+  uint32_t acc = DECIMATE_ROUND;
+
+  for(uint32_t i = 0; i < num_taps; i += 2){
+      acc = __SMLAD(decimate_pair(&window[i]), decimate_pair(&taps[i]), acc);
+  }
+  return (int16_t)__SSAT((int32_t)acc >> 15, 16);
+}
+
+//***********************************************************************************
+// global functions
+//***********************************************************************************
+/***************************************************************************//**
+ * @brief
+ *  Sets up or changes a decimation stage
+ *
+ * @details
+ *  The taps are copied, so they do not have to outlive the call, and the
+ *  delay line is cleared. Calling this again with other taps or another
+ *  factor changes the output rate at run time.
+ *
+ * @param [in] dec
+ *  Decimation state
+ *
+ * @param [in] taps
+ *  Q15 low-pass taps, their sum sets the DC gain, 32768 is a gain of 1
+ *
+ * @param [in] num_taps
+ *  Number of taps, up to DECIMATE_MAX_TAPS
+ *
+ * @param [in] factor
+ *  Input frames per output frame, 1 filters without decimating
+ *
+ ******************************************************************************/
+void decimate_open(DECIMATE_STATE *dec, const int16_t *taps, uint32_t num_taps,
+    uint32_t factor){
+  uint32_t padded;
+
+  EFM_ASSERT(num_taps && num_taps <= DECIMATE_MAX_TAPS);
+  EFM_ASSERT(factor && factor <= DECIMATE_MAX_FACTOR);
+
+  padded = (num_taps + 1) & ~1UL;
+  dec->numTaps = padded;
+  dec->factor = factor;
+  dec->phase = 0;
+  dec->pos = 0;
+  dec->taps[0] = 0;
+  for(uint32_t i = 0; i < num_taps; i++){
+      dec->taps[padded - 1 - i] = taps[i];
+  }
+  memset(dec->history, 0, sizeof(dec->history));
+
+#if DECIMATE_STATS_ENABLE
+  cycle_counter_open();
+  dec->cycles = 0;
+  dec->frames = 0;
+#endif
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Filters and decimates a block of frames
+ *
+ * @details
+ *  Every input frame goes into the delay line, written twice so the newest
+ *  numTaps samples are always one contiguous window. The filter is only run
+ *  on the frames that are kept, one in every factor, so the cost per input
+ *  frame falls as the factor goes up. The phase carries over between calls,
+ *  so blocks of any size give the same output as one long block.
+ *
+ * @param [in] dec
+ *  Decimation state from decimate_open()
+ *
+ * @param [in] in
+ *  Input frames, X Y Z
+ *
+ * @param [in] frames
+ *  Number of input frames
+ *
+ * @param [out] out
+ *  Output frames, room for frames / factor + 1 of them
+ *
+ * @return
+ *  Number of output frames written
+ *
+ ******************************************************************************/
+uint32_t decimate_process(DECIMATE_STATE *dec, const int16_t (*in)[DECIMATE_AXES],
+    uint32_t frames, int16_t (*out)[DECIMATE_AXES]){
+  uint32_t produced = 0;
+  uint32_t n = dec->numTaps;
+#if DECIMATE_STATS_ENABLE
+  uint32_t start = DWT->CYCCNT;
+#endif
+
+  for(uint32_t f = 0; f < frames; f++){
+      for(int axis = 0; axis < DECIMATE_AXES; axis++){
+          dec->history[axis][dec->pos] = in[f][axis];
+          dec->history[axis][dec->pos + n] = in[f][axis];
+      }
+      if(++dec->pos == n){
+          dec->pos = 0;
+      }
+      if(++dec->phase < dec->factor){
+          continue;
+      }
+      dec->phase = 0;
+      for(int axis = 0; axis < DECIMATE_AXES; axis++){
+          out[produced][axis] = decimate_dot(&dec->history[axis][dec->pos], dec->taps, n);
+      }
+      produced++;
+  }
+
+#if DECIMATE_STATS_ENABLE
+  dec->cycles += DWT->CYCCNT - start;
+  dec->frames += frames;
+#endif
+  return produced;
+}
+
+#if DECIMATE_STATS_ENABLE
+/***************************************************************************//**
+ * @brief
+ *  Average cost of decimate_process() per input frame
+ *
+ * @details
+ *  This is the on target benchmark of the stage: set DECIMATE_STATS_ENABLE,
+ *  run the ICM at the rate being tested and read this from the debugger.
+ *
+ * @return
+ *  Core clock cycles per input frame since decimate_open()
+ *
+ ******************************************************************************/
+uint32_t decimate_cycles_per_frame(const DECIMATE_STATE *dec){
+  if(dec->frames == 0){
+      return 0;
+  }
+  return dec->cycles / dec->frames;
+}
+#endif
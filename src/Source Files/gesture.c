@@ -0,0 +1,239 @@
+/**
+ * @file   gesture.c
+ * @brief  Finds taps, steps and shakes in blocks of accelerometer frames
+ *
+ */
+//***********************************************************************************
+// Include files
+//***********************************************************************************
+#include "gesture.h"
+
+//***********************************************************************************
+// private define statements
+//***********************************************************************************
+
+//***********************************************************************************
+// private variables
+//***********************************************************************************
+static GESTURE_OPEN_STRUCT gesture_cfg;
+static GESTURE_COUNTS gesture_counts;
+static int32_t gesture_mean[GESTURE_AXES];  //gravity, GESTURE_MEAN_SHIFT fraction bits
+static bool gesture_primed;
+static uint32_t gesture_frame;
+static bool gesture_peakTrue;
+static uint32_t gesture_peak_start;
+static uint32_t gesture_peak_max;
+static bool gesture_tap_pending;
+static uint32_t gesture_tap_frame;
+static uint32_t gesture_last_step;
+static uint32_t gesture_shake_start;
+static uint32_t gesture_shake_count;
+static uint32_t gesture_peak_activity;  //largest activity since gesture_take_activity()
+
+//***********************************************************************************
+// private function prototypes
+//***********************************************************************************
+static uint32_t gesture_activity(const int16_t frame[GESTURE_AXES]);
+static void gesture_peak_end(void);
+
+//***********************************************************************************
+// private functions
+//***********************************************************************************
+/***************************************************************************//**
+ * @brief
+ *  How far one frame is from gravity
+ *
+ * @details
+ *  Each axis keeps a running average that follows gravity as the board is
+ *  turned, and the sum of the distances from it is the activity. The average
+ *  is a shift, so there is no division or square root per frame.
+ *
+ ******************************************************************************/
+static uint32_t gesture_activity(const int16_t frame[GESTURE_AXES]){
+  uint32_t activity = 0;
+  int32_t high_pass;
+
+  if(!gesture_primed){
+      for(int axis = 0; axis < GESTURE_AXES; axis++){
+          gesture_mean[axis] = frame[axis] << GESTURE_MEAN_SHIFT;
+      }
+      gesture_primed = true;
+  }
+
+  for(int axis = 0; axis < GESTURE_AXES; axis++){
+      high_pass = frame[axis] - (gesture_mean[axis] >> GESTURE_MEAN_SHIFT);
+      gesture_mean[axis] += high_pass;
+      activity += (high_pass < 0) ? -high_pass : high_pass;
+  }
+  return activity;
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Sorts a peak that has just ended
+ *
+ * @details
+ *  Large peaks are counted towards a shake, and only the first one of a
+ *  series can be anything else. A short large peak is held as a tap until
+ *  tap_quiet_frames pass without another peak starting, so the first peak
+ *  of a shake is not sent as a tap. A longer peak far enough from the last
+ *  step is a step. A shake that goes on keeps counting from its last peak.
+ *
+ ******************************************************************************/
+static void gesture_peak_end(void){
+  uint32_t length = gesture_frame - gesture_peak_start;
+
+  if(gesture_peak_max >= gesture_cfg.shake_threshold){
+      if(gesture_shake_count == 0
+          || gesture_frame - gesture_shake_start > gesture_cfg.shake_window_frames){
+          gesture_shake_start = gesture_peak_start;
+          gesture_shake_count = 0;
+      }
+      if(++gesture_shake_count >= gesture_cfg.shake_peaks){
+          gesture_shake_start = gesture_frame;
+          gesture_shake_count = 1;
+          gesture_counts.shakes++;
+          add_scheduled_event(gesture_cfg.shake_cb);
+          return;
+      }
+      if(gesture_shake_count > 1){
+          return;
+      }
+  }
+
+  if(gesture_peak_max >= gesture_cfg.tap_threshold && length <= gesture_cfg.tap_max_frames){
+      gesture_tap_pending = true;
+      gesture_tap_frame = gesture_frame;
+  } else if(length > gesture_cfg.tap_max_frames
+      && gesture_frame - gesture_last_step >= gesture_cfg.step_min_frames){
+      gesture_last_step = gesture_frame;
+      gesture_counts.steps++;
+      add_scheduled_event(gesture_cfg.step_cb);
+  }
+}
+
+//***********************************************************************************
+// global functions
+//***********************************************************************************
+/***************************************************************************//**
+ * @brief
+ *  Sets the thresholds and callbacks of the gesture detector
+ *
+ * @details
+ *  The counts are cleared and gravity is learned again from the next frame.
+ *
+ * @param [in] gesture_open_struct
+ *  Thresholds, times and the scheduler events for a tap, a step and a shake
+ *
+ ******************************************************************************/
+void gesture_open(const GESTURE_OPEN_STRUCT *gesture_open_struct){
+  gesture_set_config(gesture_open_struct);
+  gesture_counts.taps = 0;
+  gesture_counts.steps = 0;
+  gesture_counts.shakes = 0;
+  gesture_primed = false;
+  gesture_frame = 0;
+  gesture_peakTrue = false;
+  gesture_tap_pending = false;
+  gesture_last_step = 0 - gesture_cfg.step_min_frames;
+  gesture_shake_count = 0;
+  gesture_peak_activity = 0;
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Changes the thresholds and times without losing the counts
+ *
+ * @details
+ *  Used when the frame rate changes, since the times are in frames.
+ *
+ * @param [in] gesture_open_struct
+ *  Thresholds, times and the scheduler events for a tap, a step and a shake
+ *
+ ******************************************************************************/
+void gesture_set_config(const GESTURE_OPEN_STRUCT *gesture_open_struct){
+  EFM_ASSERT(gesture_open_struct->step_threshold <= gesture_open_struct->tap_threshold);
+  EFM_ASSERT(gesture_open_struct->step_threshold <= gesture_open_struct->shake_threshold);
+  EFM_ASSERT(gesture_open_struct->shake_peaks);
+
+  gesture_cfg = *gesture_open_struct;
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Runs the gesture detector over a block of frames
+ *
+ * @details
+ *  A peak is a run of frames with the activity above step_threshold, and it
+ *  is sorted once the activity falls back below it. Blocks can be any size
+ *  and the detector carries on from the last one, so the FIFO drain and the
+ *  data ready path can both feed it. Only the events are posted, never the
+ *  frames, so the rest of the app only runs when something happened.
+ *
+ * @param [in] frames
+ *  Accelerometer frames, X Y Z, at a fixed rate
+ *
+ * @param [in] count
+ *  Number of frames
+ *
+ ******************************************************************************/
+void gesture_process(const int16_t (*frames)[GESTURE_AXES], uint32_t count){
+  uint32_t activity;
+
+  for(uint32_t i = 0; i < count; i++){
+      activity = gesture_activity(frames[i]);
+      if(activity > gesture_peak_activity){
+          gesture_peak_activity = activity;
+      }
+
+      if(activity >= gesture_cfg.step_threshold){
+          if(!gesture_peakTrue){
+              gesture_peakTrue = true;
+              gesture_tap_pending = false;
+              gesture_peak_start = gesture_frame;
+              gesture_peak_max = 0;
+          }
+          if(activity > gesture_peak_max){
+              gesture_peak_max = activity;
+          }
+      } else if(gesture_peakTrue){
+          gesture_peakTrue = false;
+          gesture_peak_end();
+      }
+
+      if(gesture_tap_pending && gesture_frame - gesture_tap_frame >= gesture_cfg.tap_quiet_frames){
+          gesture_tap_pending = false;
+          gesture_counts.taps++;
+          add_scheduled_event(gesture_cfg.tap_cb);
+      }
+      gesture_frame++;
+  }
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Copies out how many of each gesture have been found since gesture_open()
+ *
+ ******************************************************************************/
+void gesture_get_counts(GESTURE_COUNTS *counts){
+  *counts = gesture_counts;
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Largest activity seen since the last call
+ *
+ * @details
+ *  Lets a power policy see how busy the board has been without running a
+ *  second pass over the frames.
+ *
+ * @return
+ *  Largest activity, in the units of the thresholds
+ *
+ ******************************************************************************/
+uint32_t gesture_take_activity(void){
+  uint32_t activity = gesture_peak_activity;
+
+  gesture_peak_activity = 0;
+  return activity;
+}
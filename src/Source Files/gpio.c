@@ -18,6 +18,7 @@
 //***********************************************************************************
 // global variables
 //***********************************************************************************
+static uint32_t scheduled_icm_int_cb;
 
 
 //***********************************************************************************
@@ -81,4 +82,48 @@ void gpio_open(void){
 	 GPIO_PinModeSet(USART_RX_PORT, USART_RX_PIN, gpioModeInput, true);
 	 GPIO_PinModeSet(USART_CS_PORT, USART_CS_PIN, gpioModePushPull, true);
 	 GPIO_PinModeSet(USART_SCLK_PORT, USART_SCLK_PIN, gpioModePushPull, true);
+	 GPIO_PinModeSet(ICM_INT_PORT, ICM_INT_PIN, gpioModeInput, false);
+}
+
+/***************************************************************************//**
+ * @brief
+ *        This function turns on the interrupt of the icm20648 INT pin.
+ *
+ * @details
+ *        A rising edge on the INT pin adds the callback to the scheduler. The
+ *        GPIO edge interrupts are asynchronous so the pin can wake the board
+ *        from EM3.
+ *
+ * @note
+ *        The icm20648 must be set to drive INT active high
+ *
+ * @param[in] callback
+ *        Scheduler event added on every rising edge of INT
+ *
+ ******************************************************************************/
+void gpio_icm_int_open(uint32_t callback){
+  scheduled_icm_int_cb = callback;
+
+  GPIO_ExtIntConfig(ICM_INT_PORT, ICM_INT_PIN, ICM_INT_PIN, true, false, true);
+  NVIC_EnableIRQ(GPIO_EVEN_IRQn);
+}
+
+/***************************************************************************//**
+ * @brief
+ *        Interrupt handler for the even numbered GPIO pins
+ *
+ * @details
+ *        The flagged and enabled even interrupts are cleared and the icm20648
+ *        INT event is added to the scheduler. Odd interrupts are left for
+ *        GPIO_ODD_IRQHandler so their flags are not lost.
+ *
+ ******************************************************************************/
+void GPIO_EVEN_IRQHandler(void){
+  uint32_t int_flag;
+  int_flag = GPIO_IntGetEnabled() & GPIO_EVEN_INTS;
+  GPIO_IntClear(int_flag);
+
+  if(int_flag & (1 << ICM_INT_PIN)){
+      add_scheduled_event(scheduled_icm_int_cb);
+  }
 }
@@ -21,12 +21,22 @@
 static I2C_STATE_MACHINE i2c0_state_struct;
 static I2C_STATE_MACHINE i2c1_state_struct;
 
-static I2C_STATE_MACHINE *i2c_local_struct;
 
 //***********************************************************************************
 // private function prototypes
 //***********************************************************************************
-void i2c_bus_reset(I2C_TypeDef *i2c);
+bool i2c_bus_reset(I2C_TypeDef *i2c);
+static void i2c_recovery_delay(void);
+static void i2c_bus_clear(I2C_STATE_MACHINE *i2c_sm);
+static bool i2c_bus_recover(I2C_STATE_MACHINE *i2c_sm);
+static I2C_ERROR i2c_error(uint32_t int_flag);
+static void i2c_fault(I2C_STATE_MACHINE *i2c_sm, I2C_ERROR error);
+static I2C_STATE_MACHINE *i2c_get_sm(I2C_TypeDef *i2c);
+static void i2c_begin(I2C_STATE_MACHINE *i2c_sm);
+static void i2c_done(I2C_STATE_MACHINE *i2c_sm, I2C_ERROR error);
+static void i2c_ldma_write(I2C_STATE_MACHINE *i2c_sm);
+static void i2c_ldma_read(I2C_STATE_MACHINE *i2c_sm);
+static void i2c_ldma_finish(I2C_STATE_MACHINE *i2c_sm);
 
 //***********************************************************************************
 // private functions
@@ -41,13 +51,19 @@ void i2c_bus_reset(I2C_TypeDef *i2c);
  *
  * @note
  *  Using the OR command with both START and STOP in the I2C_CMD allows for reseting the I2C peripheral.
+ *  The wait for MSTOP is bounded by I2C_RESET_TIMEOUT so a bus held low by
+ *  a slave cannot hang the caller.
  *
  * @param
  *  I2C_TypeDef Struct with pointer *i2c, storing all variables to enable I2C peripheral.
  *
+ * @return
+ *  false if the STOP was never seen on the bus
+ *
  ******************************************************************************/
-void i2c_bus_reset(I2C_TypeDef *i2c){
+bool i2c_bus_reset(I2C_TypeDef *i2c){
   uint32_t save_state;
+  uint32_t timeout = I2C_RESET_TIMEOUT;
 
   i2c->CMD = I2C_CMD_ABORT;
   save_state = i2c->IEN;
@@ -56,13 +72,333 @@ void i2c_bus_reset(I2C_TypeDef *i2c){
 
   i2c->CMD = I2C_CMD_CLEARTX;
   i2c->CMD = I2C_CMD_START | I2C_CMD_STOP;
-  while(!(i2c->IF & I2C_IF_MSTOP));
+  while(!(i2c->IF & I2C_IF_MSTOP) && --timeout);
 
   i2c->IFC = i2c->IF;
   i2c->CMD = I2C_CMD_ABORT;
   i2c->IEN = save_state;
-};
+  return timeout != 0;
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Waits half an SCL period while the bus is driven by hand
+ *
+ * @details
+ *  I2C_RECOVERY_DELAY passes of a volatile loop take roughly 10 to 25 us at
+ *  the HFCLK rates of this board. That is far slower than 400 kHz on purpose.
+ *  I2C sets no lower limit on SCL, so a slow clock frees any slave, and the
+ *  few hundred microseconds a recovery takes only happen after a fault.
+ *
+ ******************************************************************************/
+static void i2c_recovery_delay(void){
+  for(volatile uint32_t i = 0; i < I2C_RECOVERY_DELAY; i++);
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Frees a bus that a slave is holding by clocking SCL from the GPIO
+ *
+ * @details
+ *  A slave that lost a clock in the middle of a read holds SDA low until it
+ *  has shifted out the rest of its byte. The pins are taken from the I2C and
+ *  SCL is pulsed up to I2C_RECOVERY_CLOCKS times until SDA goes high, then a
+ *  STOP is made by hand so the slave goes back to idle. The pins are wired
+ *  AND so driving them high only lets go of them.
+ *
+ ******************************************************************************/
+static void i2c_bus_clear(I2C_STATE_MACHINE *i2c_sm){
+  uint32_t routepen = i2c_sm->i2c->ROUTEPEN;
+
+  GPIO_PinOutSet(i2c_sm->sclPort, i2c_sm->sclPin);
+  GPIO_PinOutSet(i2c_sm->sdaPort, i2c_sm->sdaPin);
+  i2c_sm->i2c->ROUTEPEN = 0;
+
+  for(uint32_t i = 0; i < I2C_RECOVERY_CLOCKS
+      && !GPIO_PinInGet(i2c_sm->sdaPort, i2c_sm->sdaPin); i++){
+      GPIO_PinOutClear(i2c_sm->sclPort, i2c_sm->sclPin);
+      i2c_recovery_delay();
+      GPIO_PinOutSet(i2c_sm->sclPort, i2c_sm->sclPin);
+      i2c_recovery_delay();
+  }
+
+  GPIO_PinOutClear(i2c_sm->sclPort, i2c_sm->sclPin);
+  i2c_recovery_delay();
+  GPIO_PinOutClear(i2c_sm->sdaPort, i2c_sm->sdaPin);
+  i2c_recovery_delay();
+  GPIO_PinOutSet(i2c_sm->sclPort, i2c_sm->sclPin);
+  i2c_recovery_delay();
+  GPIO_PinOutSet(i2c_sm->sdaPort, i2c_sm->sdaPin);
+  i2c_recovery_delay();
+
+  i2c_sm->i2c->ROUTEPEN = routepen;
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Puts the bus and the I2C back to idle
+ *
+ * @details
+ *  i2c_bus_reset() is enough after a NACK or a glitch. If its STOP never
+ *  made it onto the bus or SDA is still low a slave is holding the bus, so
+ *  it is clocked free with i2c_bus_clear() and the I2C is reset again.
+ *
+ * @note
+ *  Takes up to a few ms of polling, so it is only called with interrupts on,
+ *  from i2c_open() and i2c_recover()
+ *
+ * @return
+ *  false if the bus is still not idle
+ *
+ ******************************************************************************/
+static bool i2c_bus_recover(I2C_STATE_MACHINE *i2c_sm){
+  if(!i2c_bus_reset(i2c_sm->i2c) || !GPIO_PinInGet(i2c_sm->sdaPort, i2c_sm->sdaPin)){
+      i2c_bus_clear(i2c_sm);
+      if(!i2c_bus_reset(i2c_sm->i2c)){
+          return false;
+      }
+  }
+  return GPIO_PinInGet(i2c_sm->sdaPort, i2c_sm->sdaPin)
+      && (i2c_sm->i2c->STATE & _I2C_STATE_STATE_MASK) == I2C_STATE_STATE_IDLE;
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Turns the error interrupt flags into an I2C_ERROR
+ *
+ ******************************************************************************/
+static I2C_ERROR i2c_error(uint32_t int_flag){
+  if(int_flag & I2C_IF_CLTO){
+      return I2C_ERR_TIMEOUT;
+  }
+  if(int_flag & I2C_IF_BUSERR){
+      return I2C_ERR_BUSERR;
+  }
+  if(int_flag & I2C_IF_ARBLOST){
+      return I2C_ERR_ARBLOST;
+  }
+  return I2C_ERR_NACK;
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Records a transfer that went wrong and hands the recovery to the scheduler
+ *
+ * @details
+ *  Any LDMA transfer is stopped and its done flag cleared so
+ *  i2c_ldma_done_sm() is not called late, and the I2C is aborted so no more
+ *  interrupts come from the broken transfer. Recovering the bus can poll
+ *  for milliseconds, so it is not done here but by i2c_recover() from the
+ *  recover callback of the bus. The transfer stays at the head of the queue
+ *  and busy stays true until then, so transfers queued in the meantime
+ *  wait behind it. Only the first fault is kept until i2c_recover() runs.
+ *
+ * @note
+ *  Called from the I2C interrupt and with interrupts off, only takes a few
+ *  register writes
+ *
+ ******************************************************************************/
+static void i2c_fault(I2C_STATE_MACHINE *i2c_sm, I2C_ERROR error){
+  if(i2c_sm->ldmaActive){
+      LDMA_StopTransfer(i2c_sm->ldmaTxCh);
+      LDMA_StopTransfer(i2c_sm->ldmaRxCh);
+      LDMA->IFC = (1 << i2c_sm->ldmaTxCh) | (1 << i2c_sm->ldmaRxCh);
+      i2c_ldma_finish(i2c_sm);
+  }
+  i2c_sm->i2c->CMD = I2C_CMD_ABORT;
+
+  if(i2c_sm->faultTrue){
+      return;
+  }
+  i2c_sm->faultTrue = true;
+  i2c_sm->faultError = error;
+  i2c_sm->recoveryCount++;
+  add_scheduled_event(i2c_sm->recoverCb);
+}
+
+
+/***************************************************************************//**
+ * @brief
+ *  Returns the state machine of I2C0 or I2C1
+ *
+ ******************************************************************************/
+static I2C_STATE_MACHINE *i2c_get_sm(I2C_TypeDef *i2c){
+  if(i2c == I2C0){
+      return &i2c0_state_struct;
+  }
+  EFM_ASSERT(i2c == I2C1);
+  return &i2c1_state_struct;
+}
 
+/***************************************************************************//**
+ * @brief
+ *  Loads the state machine with the transfer at the head of the queue and
+ *  sends the start and write address
+ *
+ * @details
+ *  The LDMA moves the payload when the bus was opened with it and the
+ *  transfer is long enough to leave the last two bytes for the CPU to ACK
+ *  and NACK.
+ *
+ * @note
+ *  Called from i2c_enqueue() when the bus is idle, from i2c_done() to
+ *  chain to the next transfer and from i2c_recover() to retry. If the bus
+ *  is not idle the transfer is handed to i2c_fault() instead of started.
+ *
+ ******************************************************************************/
+static void i2c_begin(I2C_STATE_MACHINE *i2c_sm){
+  I2C_TRANSACTION *transaction = &i2c_sm->queue[i2c_sm->queueHead];
+  I2C_TypeDef *i2c = i2c_sm->i2c;
+
+  if((i2c->STATE & _I2C_STATE_STATE_MASK) != I2C_STATE_STATE_IDLE){
+      i2c_fault(i2c_sm, I2C_ERR_BUSY);
+      return;
+  }
+
+  i2c_sm->readTrue = transaction->readTrue;
+  i2c_sm->numOfBytes = transaction->bytes;
+  i2c_sm->deviceAddress = transaction->deviceAddress;
+  i2c_sm->registerAddress = transaction->registerAddress;
+  if(transaction->buf){
+      i2c_sm->buf = transaction->buf;
+  } else {
+      i2c_sm->buf = transaction->wordBuf;
+  }
+  i2c_sm->index = 0;
+  i2c_sm->totalBytes = transaction->bytes;
+  i2c_sm->ldmaActive = i2c_sm->ldmaTrue
+      && transaction->bytes <= I2C_LDMA_MAX_BYTES
+      && (transaction->readTrue ? transaction->bytes >= I2C_LDMA_MIN_READ
+                                : transaction->bytes > 0);
+  i2c_sm->currentState = initialize;
+  i2c_sm->transferCount++;
+
+  i2c->CMD = I2C_CMD_START;
+  i2c->TXDATA = (transaction->deviceAddress<<1 | 0);
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Ends the active transfer and starts the next one in the queue
+ *
+ * @details
+ *  Reads from i2c_start() are packed into storeData, the callback is added
+ *  to the scheduler and done is called with its context while the transfer
+ *  is still at the head of the queue. A failed transfer adds the error
+ *  callback of the bus instead and done is told the error. The transfer is
+ *  then taken off the queue. If another transfer is waiting it is started
+ *  right away from this interrupt, so a queued sequence runs back to back
+ *  with the core in EM1, otherwise EM2 is unblocked and the busy bit is set
+ *  to false.
+ *
+ * @note
+ *  done may call i2c_enqueue(), what it adds runs after the transfers that
+ *  are already queued
+ *
+ ******************************************************************************/
+static void i2c_done(I2C_STATE_MACHINE *i2c_sm, I2C_ERROR error){
+  I2C_TRANSACTION *transaction = &i2c_sm->queue[i2c_sm->queueHead];
+
+  if(i2c_sm->ldmaActive){
+      i2c_ldma_finish(i2c_sm);
+  }
+  if(error == I2C_OK){
+      if(transaction->readTrue && transaction->storeData){
+          *(transaction->storeData) = 0;
+          for(uint32_t i = 0; i < transaction->bytes; i++){
+              *(transaction->storeData) = (*(transaction->storeData) << 8) | i2c_sm->buf[i];
+          }
+      }
+      add_scheduled_event(transaction->callback);
+  } else {
+      i2c_sm->lastError = error;
+      i2c_sm->errorCount++;
+      add_scheduled_event(i2c_sm->errorCb);
+  }
+  if(transaction->done){
+      transaction->done(transaction->context, error);
+  }
+
+  i2c_sm->queueHead = (i2c_sm->queueHead + 1) % I2C_QUEUE_DEPTH;
+  i2c_sm->queueCount--;
+
+  if(i2c_sm->queueCount){
+      i2c_sm->retriesLeft = i2c_sm->retries;
+      i2c_begin(i2c_sm);
+  } else {
+      sleep_unblock_mode(EM2);
+      i2c_sm->busy = false;
+  }
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Hands the payload of a write to the LDMA
+ *
+ * @details
+ *  Called once the register address has been ACKed. The LDMA fills TXDATA
+ *  on TXBL and AUTOSE sends the stop once the last byte has gone out and TX
+ *  is empty, so the next interrupt is MSTOP. The ACK interrupt is off until
+ *  then so no interrupt is taken per byte. The channel is started before
+ *  AUTOSE is set so the empty buffer cannot stop the bus early.
+ *
+ ******************************************************************************/
+static void i2c_ldma_write(I2C_STATE_MACHINE *i2c_sm){
+  LDMA_TransferCfg_t tx_cfg = LDMA_TRANSFER_CFG_PERIPHERAL(i2c_sm->ldmaTxSignal);
+  LDMA_Descriptor_t tx_desc = LDMA_DESCRIPTOR_SINGLE_M2P_BYTE(i2c_sm->buf,
+      &i2c_sm->i2c->TXDATA, i2c_sm->numOfBytes);
+
+  tx_desc.xfer.doneIfs = false;
+  i2c_sm->ldmaDesc[0] = tx_desc;
+  i2c_sm->numOfBytes = 0;
+
+  i2c_sm->i2c->IEN &= ~I2C_IF_ACK;
+  LDMA_StartTransfer(i2c_sm->ldmaTxCh, &tx_cfg, &i2c_sm->ldmaDesc[0]);
+  i2c_sm->i2c->CTRL |= I2C_CTRL_AUTOSE;
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Hands all but the last two bytes of a read to the LDMA
+ *
+ * @details
+ *  Called once the read address has been ACKed. AUTOACK ACKs each byte the
+ *  LDMA takes from RXDATA, so the slave keeps sending without the CPU. A
+ *  write descriptor linked after the payload clears AUTOACK as soon as the
+ *  LDMA has taken its last byte, a full byte time before the next one is
+ *  ACKed, so no interrupt latency decides what the slave sees. The last two
+ *  bytes are then left for the RXDATAV interrupt, which i2c_ldma_done_sm()
+ *  turns back on, and i2c_read_sm() ACKs the first and NACKs the last.
+ *
+ ******************************************************************************/
+static void i2c_ldma_read(I2C_STATE_MACHINE *i2c_sm){
+  uint32_t ctrl = i2c_sm->i2c->CTRL;
+  LDMA_TransferCfg_t rx_cfg = LDMA_TRANSFER_CFG_PERIPHERAL(i2c_sm->ldmaRxSignal);
+  LDMA_Descriptor_t rx_desc = LDMA_DESCRIPTOR_LINKREL_P2M_BYTE(&i2c_sm->i2c->RXDATA,
+      i2c_sm->buf, i2c_sm->numOfBytes - 2, 1);
+  LDMA_Descriptor_t ack_off = LDMA_DESCRIPTOR_SINGLE_WRITE(ctrl & ~I2C_CTRL_AUTOACK,
+      &i2c_sm->i2c->CTRL);
+
+  rx_desc.xfer.doneIfs = false;
+  i2c_sm->ldmaDesc[0] = rx_desc;
+  i2c_sm->ldmaDesc[1] = ack_off;
+
+  i2c_sm->i2c->IEN &= ~I2C_IF_RXDATAV;
+  i2c_sm->i2c->CTRL = ctrl | I2C_CTRL_AUTOACK;
+  LDMA_StartTransfer(i2c_sm->ldmaRxCh, &rx_cfg, &i2c_sm->ldmaDesc[0]);
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Puts the I2C back to CPU mode once an LDMA transfer has stopped
+ *
+ ******************************************************************************/
+static void i2c_ldma_finish(I2C_STATE_MACHINE *i2c_sm){
+  i2c_sm->i2c->CTRL &= ~(I2C_CTRL_AUTOSE | I2C_CTRL_AUTOACK);
+  i2c_sm->i2c->IFC = I2C_IF_ACK;
+  i2c_sm->i2c->IEN |= I2C_IF_ACK | I2C_IF_RXDATAV;
+  i2c_sm->ldmaActive = false;
+}
 
 //***********************************************************************************
 // global functions
@@ -73,7 +409,11 @@ void i2c_bus_reset(I2C_TypeDef *i2c){
  *
  * @details
  *  In this function I2C is initialized, the pins are routed, the interrupt (ACK,
- *  RXDATAV, AND MSTOP) are enabled and bus reset is called.
+ *  RXDATAV, AND MSTOP) are enabled and bus reset is called. With ldma_en the
+ *  RX channel is claimed so its done interrupt reaches i2c_ldma_done_sm().
+ *  The NACK, ARBLOST, BUSERR and clock low timeout interrupts go to
+ *  i2c_fault(), and the bus idle timeout lets the I2C see a bus that was
+ *  left busy by a glitch as idle again.
  *
  * @note
  *  Called in Si1133_open
@@ -87,13 +427,47 @@ void i2c_bus_reset(I2C_TypeDef *i2c){
  ******************************************************************************/
 void i2c_open(I2C_TypeDef *i2c, I2C_OPEN_STRUCT *i2c_setup){
   I2C_Init_TypeDef i2c_values;
+  I2C_STATE_MACHINE *i2c_sm;
 
   if (i2c == I2C0){
       CMU_ClockEnable(cmuClock_I2C0,true);
-      i2c0_state_struct.busy = false;
-  } else if(i2c == I2C1){
+      i2c_sm = &i2c0_state_struct;
+      i2c_sm->ldmaTxSignal = ldmaPeripheralSignal_I2C0_TXBL;
+      i2c_sm->ldmaRxSignal = ldmaPeripheralSignal_I2C0_RXDATAV;
+  } else {
+      EFM_ASSERT(i2c == I2C1);
       CMU_ClockEnable(cmuClock_I2C1,true);
-      i2c1_state_struct.busy = false;
+      i2c_sm = &i2c1_state_struct;
+      i2c_sm->ldmaTxSignal = ldmaPeripheralSignal_I2C1_TXBL;
+      i2c_sm->ldmaRxSignal = ldmaPeripheralSignal_I2C1_RXDATAV;
+  }
+  i2c_sm->i2c = i2c;
+  i2c_sm->busy = false;
+  i2c_sm->queueHead = 0;
+  i2c_sm->queueCount = 0;
+  i2c_sm->queueHighWater = 0;
+  i2c_sm->sclPort = i2c_setup->scl_port;
+  i2c_sm->sclPin = i2c_setup->scl_pin;
+  i2c_sm->sdaPort = i2c_setup->sda_port;
+  i2c_sm->sdaPin = i2c_setup->sda_pin;
+  i2c_sm->retries = i2c_setup->retries;
+  i2c_sm->errorCb = i2c_setup->error_cb;
+  i2c_sm->recoverCb = i2c_setup->recover_cb;
+  i2c_sm->faultTrue = false;
+  i2c_sm->faultError = I2C_OK;
+  i2c_sm->transferCount = 0;
+  i2c_sm->watchdogCount = 0;
+  i2c_sm->lastError = I2C_OK;
+  i2c_sm->errorCount = 0;
+  i2c_sm->recoveryCount = 0;
+  i2c_sm->ldmaTrue = i2c_setup->ldma_en;
+  i2c_sm->ldmaActive = false;
+
+  if(i2c_setup->ldma_en){
+      i2c_sm->ldmaTxCh = i2c_setup->ldma_tx_ch;
+      i2c_sm->ldmaRxCh = i2c_setup->ldma_rx_ch;
+      ldma_open();
+      ldma_channel_open(i2c_setup->ldma_rx_ch, i2c_ldma_done_sm, i2c_sm);
   }
 
   if ((i2c->IF & 0x01) == 0) {
@@ -112,17 +486,19 @@ void i2c_open(I2C_TypeDef *i2c, I2C_OPEN_STRUCT *i2c_setup){
   i2c_values.clhr = i2c_setup->clhr;
 
   I2C_Init(i2c, &i2c_values);
+  i2c->CTRL |= I2C_CTRL_CLTO_1024PPC | I2C_CTRL_BITO_160PCC | I2C_CTRL_GIBITO;
 
   i2c->ROUTELOC0 = i2c_setup->out_pin_route_scl | i2c_setup->out_pin_route_sda; //make sure to set the pin route var
 
   i2c->ROUTEPEN = (I2C_ROUTEPEN_SCLPEN*i2c_setup->out_pin_scl_en)
       | (I2C_ROUTEPEN_SDAPEN*i2c_setup->out_pin_sda_en);
 
-  i2c_bus_reset(i2c);
+  i2c_bus_recover(i2c_sm);
   i2c->IFC = i2c->IF;
   i2c->IEN |= I2C_IF_ACK;
   i2c->IEN |= I2C_IF_RXDATAV;
   i2c->IEN |= I2C_IF_MSTOP;
+  i2c->IEN |= I2C_ERROR_FLAGS;
 
   if (i2c == I2C0){
     NVIC_EnableIRQ(I2C0_IRQn);
@@ -137,7 +513,10 @@ void i2c_open(I2C_TypeDef *i2c, I2C_OPEN_STRUCT *i2c_setup){
  *
  * @details
  *  Passing in the specific I2C peripheral I2C0 vs. I2C1, the function checks for the correct
- *  peripheral to configure for use with the Mighy Gecko.
+ *  peripheral to configure for use with the Mighy Gecko. Up to I2C_WORD_BYTES
+ *  bytes are moved, packed high byte first into write_data and storeData.
+ *  Longer transfers use i2c_transfer(). The transfer is queued behind any
+ *  transfer already on the bus and the function returns right away.
  *
  * @note
  *  Using if statements and comparing the value of the *i2c the function checks the correct value
@@ -175,32 +554,128 @@ void i2c_open(I2C_TypeDef *i2c, I2C_OPEN_STRUCT *i2c_setup){
 void i2c_start(I2C_TypeDef *i2c, bool readTrue, uint32_t bytes, uint32_t deviceAddress,
                uint32_t registerAddress, uint32_t callback, uint32_t *storeData,
                uint32_t write_data){
+  I2C_TRANSACTION transaction;
 
-  if (i2c == I2C0){
-      i2c_local_struct = &i2c0_state_struct;
-  }else if(i2c == I2C1){
-      i2c_local_struct = &i2c1_state_struct;
+  EFM_ASSERT(bytes <= I2C_WORD_BYTES);
+
+  transaction.readTrue = readTrue;
+  transaction.deviceAddress = deviceAddress;
+  transaction.registerAddress = registerAddress;
+  transaction.buf = NULL;
+  transaction.bytes = bytes;
+  transaction.callback = callback;
+  transaction.done = NULL;
+  transaction.context = NULL;
+  transaction.storeData = storeData;
+  for(uint32_t i = 0; i < bytes; i++){
+      transaction.wordBuf[i] = (write_data >> (8 * (bytes - 1 - i))) & MASK;
   }
+  i2c_enqueue(i2c, &transaction);
+}
 
-  while(i2c_local_struct->busy);
-  EFM_ASSERT((i2c->STATE & _I2C_STATE_STATE_MASK) == I2C_STATE_STATE_IDLE);
+/***************************************************************************//**
+ * @brief
+ *  Reads or writes any number of bytes from caller owned memory
+ *
+ * @details
+ *  The register address is sent first, then bytes are written from buf or,
+ *  after a repeated start, read into buf in bus order. buf must stay valid
+ *  until the callback runs. A write of 0 bytes only sends the register
+ *  address, which is how a register pointer is set. The transfer is queued
+ *  and the function returns right away.
+ *
+ * @param [in] i2c
+ *  I2C0 or I2C1
+ *
+ * @param [in] readTrue
+ *  true to read into buf, false to write buf
+ *
+ * @param [in] deviceAddress
+ *  7 bit address of the device
+ *
+ * @param [in] registerAddress
+ *  First register of the transfer
+ *
+ * @param [in] buf
+ *  Bytes to write or room for the bytes read
+ *
+ * @param [in] bytes
+ *  Number of bytes, reads need at least 1
+ *
+ * @param [in] callback
+ *  Callback added to the scheduler once the stop has been sent
+ *
+ ******************************************************************************/
+void i2c_transfer(I2C_TypeDef *i2c, bool readTrue, uint32_t deviceAddress,
+                  uint32_t registerAddress, uint8_t *buf, uint32_t bytes,
+                  uint32_t callback){
+  I2C_TRANSACTION transaction;
 
-  i2c_local_struct->i2c = i2c;
-  i2c_local_struct->readTrue = readTrue;
-  i2c_local_struct->numOfBytes = bytes;
-  i2c_local_struct->deviceAddress = deviceAddress;
-  i2c_local_struct->registerAddress = registerAddress;
-  i2c_local_struct->callback = callback;
-  i2c_local_struct->storeData = storeData;
-  i2c_local_struct->writeData = write_data;
+  transaction.readTrue = readTrue;
+  transaction.deviceAddress = deviceAddress;
+  transaction.registerAddress = registerAddress;
+  transaction.buf = buf;
+  transaction.bytes = bytes;
+  transaction.callback = callback;
+  transaction.done = NULL;
+  transaction.context = NULL;
+  transaction.storeData = NULL;
+  i2c_enqueue(i2c, &transaction);
+}
 
-  sleep_block_mode(EM2);
-  i2c_local_struct->busy = true;
-  i2c_local_struct->currentState = initialize; // WHAT DO I INITLAIZE THIS TO
+/***************************************************************************//**
+ * @brief
+ *  Adds a transfer to the queue of a bus
+ *
+ * @details
+ *  The transfer is copied, so the caller's struct can be reused right away,
+ *  but buf must stay valid until the transfer is done. If the bus is idle
+ *  EM2 is blocked and the transfer is started, otherwise it is started from
+ *  the I2C interrupt when the transfers ahead of it are done. A sequence of
+ *  transfers can be queued at once this way and the core sleeps until done
+ *  or the scheduler event of the last one.
+ *
+ * @note
+ *  Safe to call from an interrupt, including from done
+ *
+ * @param [in] i2c
+ *  I2C0 or I2C1
+ *
+ * @param [in] transaction
+ *  Transfer to be copied into the queue
+ *
+ ******************************************************************************/
+void i2c_enqueue(I2C_TypeDef *i2c, const I2C_TRANSACTION *transaction){
+  I2C_STATE_MACHINE *i2c_sm = i2c_get_sm(i2c);
+  uint32_t slot;
 
-  i2c->CMD = I2C_CMD_START;
-  i2c->TXDATA = (deviceAddress<<1 | 0);
+  EFM_ASSERT(!transaction->readTrue || transaction->bytes > 0);
+  EFM_ASSERT(transaction->buf || transaction->bytes <= I2C_WORD_BYTES);
+
+  CORE_DECLARE_IRQ_STATE;
+  CORE_ENTER_CRITICAL();
+
+  if(i2c_sm->queueCount == I2C_QUEUE_DEPTH){
+      CORE_EXIT_CRITICAL();
+      EFM_ASSERT(false);
+      return;
+  }
+
+  slot = (i2c_sm->queueHead + i2c_sm->queueCount) % I2C_QUEUE_DEPTH;
+  i2c_sm->queue[slot] = *transaction;
+  i2c_sm->queueCount++;
+  if(i2c_sm->queueCount > i2c_sm->queueHighWater){
+      i2c_sm->queueHighWater = i2c_sm->queueCount;
+  }
+
+  if(!i2c_sm->busy){
+      sleep_block_mode(EM2);
+      i2c_sm->busy = true;
+      i2c_sm->retriesLeft = i2c_sm->retries;
+      i2c_begin(i2c_sm);
+  }
 
+  CORE_EXIT_CRITICAL();
 }
 
 /***************************************************************************//**
@@ -212,7 +687,8 @@ void i2c_start(I2C_TypeDef *i2c, bool readTrue, uint32_t bytes, uint32_t deviceA
  *  to enter for next process.
  *
  * @note
- *  IRQHandler specific to the I2C0 peripheral, seperate from I2C1.
+ *  IRQHandler specific to the I2C0 peripheral, seperate from I2C1. An error
+ *  flag ends the handling of the interrupt and is handed to i2c_fault().
  *
  ******************************************************************************/
 void I2C0_IRQHandler(void){
@@ -220,6 +696,11 @@ void I2C0_IRQHandler(void){
   int_flag = I2C0->IF & I2C0->IEN;
   I2C0->IFC = int_flag;
 
+  if(int_flag & I2C_ERROR_FLAGS){
+      i2c_fault(&i2c0_state_struct, i2c_error(int_flag));
+      return;
+  }
+
   if(int_flag & I2C_IF_ACK){
       EFM_ASSERT(!(I2C0->IF & I2C_IF_ACK));
       i2c_ack_sm(&i2c0_state_struct);
@@ -244,7 +725,8 @@ void I2C0_IRQHandler(void){
  *  to enter for next process.
  *
  * @note
- *  IRQHandler specific to the I2C1 peripheral, seperate from I2C0.
+ *  IRQHandler specific to the I2C1 peripheral, seperate from I2C0. An error
+ *  flag ends the handling of the interrupt and is handed to i2c_fault().
  *
  ******************************************************************************/
 void I2C1_IRQHandler(void){
@@ -252,6 +734,11 @@ void I2C1_IRQHandler(void){
   int_flag = I2C1->IF & I2C1->IEN;
   I2C1->IFC = int_flag;
 
+  if(int_flag & I2C_ERROR_FLAGS){
+      i2c_fault(&i2c1_state_struct, i2c_error(int_flag));
+      return;
+  }
+
   if(int_flag & I2C_IF_ACK){
       EFM_ASSERT(!(I2C1->IF & I2C_IF_ACK));
       i2c_ack_sm(&i2c1_state_struct);
@@ -294,15 +781,24 @@ void i2c_ack_sm(I2C_STATE_MACHINE *i2c_sm){
           i2c_sm->i2c->CMD = I2C_CMD_START;
           i2c_sm->i2c->TXDATA = (i2c_sm->deviceAddress<<1 | 1);
           i2c_sm->currentState = send_DA;
+      } else if(i2c_sm->ldmaActive){
+          i2c_ldma_write(i2c_sm);
+          i2c_sm->currentState = send_stop;
+      } else if(i2c_sm->numOfBytes == 0){
+          i2c_sm->i2c->CMD = I2C_CMD_STOP;
+          i2c_sm->currentState = send_stop;
       } else {
           i2c_sm->numOfBytes--;
-          i2c_sm->i2c->TXDATA = (i2c_sm->writeData>>(8*i2c_sm->numOfBytes)) & MASK; //writing data to Si1133
+          i2c_sm->i2c->TXDATA = i2c_sm->buf[i2c_sm->index++]; //writing data to Si1133
           i2c_sm->currentState = write_data;
       }
       break;
 
     case send_DA:
       if(i2c_sm->readTrue){
+          if(i2c_sm->ldmaActive){
+              i2c_ldma_read(i2c_sm);
+          }
           i2c_sm->currentState = read_data;
       } else {
           EFM_ASSERT(false);
@@ -316,7 +812,7 @@ void i2c_ack_sm(I2C_STATE_MACHINE *i2c_sm){
     case write_data:
       if(i2c_sm->numOfBytes > 0){
           i2c_sm->numOfBytes--;
-          i2c_sm->i2c->TXDATA = (i2c_sm->writeData>>(8*i2c_sm->numOfBytes)) & MASK; //writing data to Si1133
+          i2c_sm->i2c->TXDATA = i2c_sm->buf[i2c_sm->index++]; //writing data to Si1133
       } else {
 
           i2c_sm->i2c->CMD = I2C_CMD_STOP;
@@ -362,8 +858,7 @@ void i2c_read_sm(I2C_STATE_MACHINE *i2c_sm){
 
     case read_data:
       if(i2c_sm->numOfBytes > 0){
-          *(i2c_sm->storeData) = ((i2c_sm->i2c->RXDATA)<<(8*(i2c_sm->numOfBytes-1))); //either shift data over or make it an array
-//          i2c_sm->storeData++;
+          i2c_sm->buf[i2c_sm->index++] = i2c_sm->i2c->RXDATA;
           i2c_sm->numOfBytes--;
           if(i2c_sm->numOfBytes == 0){
               i2c_sm->i2c->CMD = I2C_CMD_NACK;
@@ -428,9 +923,7 @@ void i2c_stop_sm(I2C_STATE_MACHINE *i2c_sm){
       break;
 
     case send_stop:
-      add_scheduled_event(i2c_sm->callback);
-      sleep_unblock_mode(EM2);
-      i2c_sm->busy = false;
+      i2c_done(i2c_sm, I2C_OK);
       break;
 
     default:
@@ -444,11 +937,8 @@ void i2c_stop_sm(I2C_STATE_MACHINE *i2c_sm){
  *
  * @details
  *    Get_i2c_busy() checks whether I2C0 OR I2C1 is being used, then returns the
- *    corresponding busy bool variable in the i2c state struct
- *
- * @note
- *    Used in Si1133_config() function to check to see whether the i2c is being
- *    used or not
+ *    corresponding busy bool variable in the i2c state struct, which stays
+ *    true until the queue of the bus is empty
  *
  * @param [in] i2c_sm
  *    I2C_STATE_MACHINE *i2c_sm which holds the state of the I2C peripheral and configuring data.
@@ -461,3 +951,148 @@ bool get_i2c_busy(I2C_TypeDef *i2c){
       return i2c1_state_struct.busy;
   }
 }
+
+/***************************************************************************//**
+ * @brief
+ *  Returns the most transfers that have been in the queue of a bus at once
+ *
+ * @details
+ *  Used to tune I2C_QUEUE_DEPTH. If the high water mark reaches
+ *  I2C_QUEUE_DEPTH transfers are being added faster than the bus moves them.
+ *
+ * @param [in] i2c
+ *  I2C0 or I2C1
+ *
+ ******************************************************************************/
+uint32_t i2c_queue_high_water(I2C_TypeDef *i2c){
+  return i2c_get_sm(i2c)->queueHighWater;
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Fails a transfer that has been on the bus too long
+ *
+ * @details
+ *  The clock low timeout only sees a slave holding SCL. A transfer can
+ *  also stall with the bus idle, for example if an interrupt is lost, so
+ *  this is called at a steady rate and a transfer that was already active
+ *  at the last call is handed to i2c_fault() with I2C_ERR_TIMEOUT, then
+ *  recovered and retried by i2c_recover() as usual.
+ *
+ * @note
+ *  Called from the scheduler, the period must be longer than the longest
+ *  transfer
+ *
+ * @param [in] i2c
+ *  I2C0 or I2C1
+ *
+ ******************************************************************************/
+void i2c_watchdog(I2C_TypeDef *i2c){
+  I2C_STATE_MACHINE *i2c_sm = i2c_get_sm(i2c);
+
+  CORE_DECLARE_IRQ_STATE;
+  CORE_ENTER_CRITICAL();
+  if(i2c_sm->busy && !i2c_sm->faultTrue
+      && i2c_sm->transferCount == i2c_sm->watchdogCount){
+      i2c_fault(i2c_sm, I2C_ERR_TIMEOUT);
+  }
+  i2c_sm->watchdogCount = i2c_sm->transferCount;
+  CORE_EXIT_CRITICAL();
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Recovers a bus after a fault and retries or fails the transfer
+ *
+ * @details
+ *  The bus is recovered with interrupts on, so the polling and the SCL
+ *  pulses of i2c_bus_recover() do not hold off the other interrupts. The
+ *  transfer at the head of the queue is then started again while it has
+ *  retries left. If it has none, or the bus could not be brought back to
+ *  idle, it is ended with the error and the queue moves on, so one bad
+ *  transfer does not stop the ones behind it. A fault with nothing on the
+ *  bus only recovers the bus.
+ *
+ * @note
+ *  Called from the scheduler when the recover_cb of the bus is posted by
+ *  i2c_fault()
+ *
+ * @param [in] i2c
+ *  I2C0 or I2C1
+ *
+ ******************************************************************************/
+void i2c_recover(I2C_TypeDef *i2c){
+  I2C_STATE_MACHINE *i2c_sm = i2c_get_sm(i2c);
+  bool recoveredTrue;
+
+  if(!i2c_sm->faultTrue){
+      return;
+  }
+  recoveredTrue = i2c_bus_recover(i2c_sm);
+
+  CORE_DECLARE_IRQ_STATE;
+  CORE_ENTER_CRITICAL();
+  i2c_sm->faultTrue = false;
+  if(i2c_sm->busy){
+      if(recoveredTrue && i2c_sm->retriesLeft){
+          i2c_sm->retriesLeft--;
+          i2c_begin(i2c_sm);
+      } else {
+          i2c_done(i2c_sm, i2c_sm->faultError);
+      }
+  }
+  CORE_EXIT_CRITICAL();
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Returns the last error of a bus
+ *
+ * @details
+ *  Used by the error callback to see what went wrong and how often.
+ *
+ * @param [in] i2c
+ *  I2C0 or I2C1
+ *
+ * @param [out] errorCount
+ *  Transfers that failed after all retries, or NULL
+ *
+ * @param [out] recoveryCount
+ *  Faults the bus was recovered from, including retried ones, or NULL
+ *
+ ******************************************************************************/
+I2C_ERROR i2c_get_last_error(I2C_TypeDef *i2c, uint32_t *errorCount, uint32_t *recoveryCount){
+  I2C_STATE_MACHINE *i2c_sm = i2c_get_sm(i2c);
+
+  if(errorCount){
+      *errorCount = i2c_sm->errorCount;
+  }
+  if(recoveryCount){
+      *recoveryCount = i2c_sm->recoveryCount;
+  }
+  return i2c_sm->lastError;
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Called when the LDMA has read all but the last two bytes of a read
+ *
+ * @details
+ *  The LDMA has already cleared AUTOACK, so RXDATAV is turned back on and
+ *  i2c_read_sm() ACKs the next to last byte, then NACKs the last one and
+ *  sends the stop.
+ *
+ * @note
+ *  Registered with ldma_channel_open() in i2c_open() when ldma_en is set
+ *
+ * @param [in] context
+ *  I2C_STATE_MACHINE *i2c_sm of the I2C that owns the channel
+ *
+ ******************************************************************************/
+void i2c_ldma_done_sm(void *context){
+  I2C_STATE_MACHINE *i2c_sm = context;
+
+  i2c_sm->index = i2c_sm->totalBytes - 2;
+  i2c_sm->numOfBytes = 2;
+  i2c_sm->i2c->IEN |= I2C_IF_RXDATAV;
+}
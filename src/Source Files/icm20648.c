@@ -18,75 +18,71 @@
 // private variables
 //***********************************************************************************
 uint32_t usart_read_result;
+static uint32_t current_bank = ICM_BANK_UNKNOWN;
+static uint8_t shadow[ICM_NUM_BANKS][ICM_NUM_REGS];
+static uint8_t shadow_valid[ICM_NUM_BANKS][ICM_NUM_REGS / 8];
+static uint32_t elided_count;
+static uint8_t sample_buf[ICM_SAMPLE_BYTES];
+static icm20648_sample_t drdy_buf[2];   //[drdy_front] is published
+static uint32_t drdy_front;
+static bool drdy_readTrue;      //the back buffer holds a read not yet published
+static uint8_t fifo_count_buf[FIFO_COUNT_BYTES];
+static uint8_t fifo_ring[ICM_FIFO_RING_FRAMES * ICM_FIFO_FRAME_BYTES];
+static uint32_t fifo_head;      //next frame to pop
+static uint32_t fifo_fill;      //frames drained and not popped
+static uint32_t fifo_pending;   //frames of the drain in flight
+
+//bring-up sequence run by icm20648_init_step(), one transfer per step
+static const ICM_INIT_STEP icm_init_table[] = {
+  {ICM_STEP_CHECK, 0, WHO_AM_I_REG, ICM_DA},
+  //enable low power mode and disable the temp sensor in PWR MGMT 1
+  {ICM_STEP_WRITE, 0, PWR_MGMT_1_REG, PWR_MGMT_1_DATA},
+  //enable accel and disable gyroscope
+  {ICM_STEP_WRITE, 0, PWR_MGMT_2_REG, PWR_MGMT_2_DATA},
+  //enable accel to operate in duty cycle mode
+  {ICM_STEP_WRITE, 0, LP_CONFIG_REG, LP_CONFIG_DATA},
+  //set accel thresh to 240 mg
+  {ICM_STEP_WRITE, 2, ACCEL_WOM_THR_REG, ACCEL_WOM_THR_DATA},
+#ifdef ICM_VERIFY_WRITES
+  {ICM_STEP_CHECK, 0, PWR_MGMT_1_REG, PWR_MGMT_1_DATA},
+  {ICM_STEP_CHECK, 0, PWR_MGMT_2_REG, PWR_MGMT_2_DATA},
+  {ICM_STEP_CHECK, 0, LP_CONFIG_REG, LP_CONFIG_DATA},
+  {ICM_STEP_CHECK, 2, ACCEL_WOM_THR_REG, ACCEL_WOM_THR_DATA},
+#endif
+  {ICM_STEP_BANK, 0, 0, 0},
+  {ICM_STEP_END, 0, 0, 0},
+};
+static uint32_t init_index;
+static uint32_t init_retries;
+static bool init_checkTrue;     //a check read is waiting for its callback
+static uint32_t init_step_cb;
+static uint32_t init_ready_cb;
+static uint32_t init_error_cb;
 
 //***********************************************************************************
 // private function prototypes
 //***********************************************************************************
-void icm20648_config(void);
+static bool icm20648_uncached(uint32_t bank, uint32_t reg, uint8_t data);
 
 //***********************************************************************************
 // private functions
 //***********************************************************************************
 /***************************************************************************//**
  * @brief
- *  This function is the tst driven development for the SPI peripheral
+ *  Returns true for writes that must always be sent and never shadowed
  *
  * @details
- *  icm20648_config() tests the performance of the spi peripheral by writing to
- *  different registers and reading from the register to check that the write
- *  save correctly
- *
- * @note
- *  The registers are in different banks (0-4), so REG_BANK_SEL must be written
- *  to in order to switch between banks.
+ *  FIFO_RST is a strobe, writing the same value again is another reset, and
+ *  DEVICE_RESET in PWR_MGMT_1 clears itself, so neither register holds what
+ *  was last written to it.
  *
  ******************************************************************************/
-void icm20648_config(void){
-  //for each write to the config reg
-  //we will do a read to confirm the write was done correctly
-
-  //wait 22 microseconds
-  timer_delay(ICM_WRITE_DELAY);
-
-  icm20648_read(WHO_AM_I_REG, WHO_AM_I_BYTES, NOP);
-  timer_delay(ICM_WRITE_DELAY);
-  EFM_ASSERT(usart_read_result == ICM_DA);
-
-  timer_delay(ICM_WRITE_DELAY);
-
-  //enable low power mode and disable the temp sensor in PWR MGMT 1
-  icm20648_write(PWR_MGMT_1_REG, PWR_MGMT_1_BYTES, PWR_MGMT_1_DATA, NOP);
-  timer_delay(ICM_WRITE_DELAY);
-  icm20648_read(PWR_MGMT_1_REG, PWR_MGMT_1_BYTES, NOP);
-  timer_delay(ICM_WRITE_DELAY);
-  EFM_ASSERT(usart_read_result == PWR_MGMT_1_DATA);
-
-  //enable accel and disable gyroscope
-  icm20648_write(PWR_MGMT_2_REG, PWR_MGMT_2_BYTES, PWR_MGMT_2_DATA, NOP);
-  timer_delay(ICM_WRITE_DELAY);
-  icm20648_read(PWR_MGMT_2_REG, PWR_MGMT_2_BYTES, NOP);
-  timer_delay(ICM_WRITE_DELAY);
-  EFM_ASSERT(usart_read_result == PWR_MGMT_2_DATA);
-
-  //enable accel to operate in duty cycle mode
-  icm20648_write(LP_CONFIG_REG, LP_CONFIG_BYTES, LP_CONFIG_DATA, NOP);
-  timer_delay(ICM_WRITE_DELAY);
-  icm20648_read(LP_CONFIG_REG, LP_CONFIG_BYTES, NOP);
-  timer_delay(ICM_WRITE_DELAY);
-  EFM_ASSERT(usart_read_result == LP_CONFIG_DATA);
-
-  icm20648_write(REG_BANK_SEL_REG, REG_BANK_SEL_BYTES, REG_BANK_2_DATA, NOP);
-  timer_delay(ICM_WRITE_DELAY);
-
-  //set accel thresh to 240 mg
-  icm20648_write(ACCEL_WOM_THR_REG, ACCEL_WOM_THR_BYTES, ACCEL_WOM_THR_DATA, NOP);
-  timer_delay(ICM_WRITE_DELAY);
-  icm20648_read(ACCEL_WOM_THR_REG, ACCEL_WOM_THR_BYTES, NOP);
-  timer_delay(ICM_WRITE_DELAY);
-  EFM_ASSERT(usart_read_result == ACCEL_WOM_THR_DATA);
-
-  icm20648_write(REG_BANK_SEL_REG, REG_BANK_SEL_BYTES, REG_BANK_0_DATA, NOP);
-  timer_delay(ICM_WRITE_DELAY);
+static bool icm20648_uncached(uint32_t bank, uint32_t reg, uint8_t data){
+  if(bank != 0){
+      return false;
+  }
+  return reg == FIFO_RST_REG
+      || (reg == PWR_MGMT_1_REG && (data & PWR_MGMT_1_DEVICE_RESET));
 }
 
 //***********************************************************************************
@@ -98,21 +94,32 @@ void icm20648_config(void){
  *
  * @details
  *  icm20648_open() defines all of the variables in the spi_setup_struct, calls
- *  spi_open with the setup struct as an input argument, and calls incm20648_config()
- *  to test the functionality of the spi peripheral. The struct spi_setup_struct
+ *  spi_open with the setup struct as an input argument, and starts the
+ *  bring-up sequence with icm20648_init_step(). The struct spi_setup_struct
  *  has varibales that are used in the intialization struct, along with the pin
- *  locations and pin enables.
+ *  locations and pin enables and the LDMA channels used to move each frame.
  *
  * @note
  *  This function is called in app_peripheral_setup in app.c
  *
+ * @param [in] step_cb
+ *  Callback whose scheduled function must call icm20648_init_step()
+ *
+ * @param [in] ready_cb
+ *  Callback added to the scheduler once the icm20648 is configured
+ *
+ * @param [in] error_cb
+ *  Callback added to the scheduler if a check still fails after
+ *  ICM_STARTUP_RETRIES tries, the bring-up stops there
+ *
  ******************************************************************************/
-void icm20648_open(void){
+void icm20648_open(uint32_t step_cb, uint32_t ready_cb, uint32_t error_cb){
   SPI_OPEN_STRUCT spi_setup_struct;
 
   spi_setup_struct.enable = ICM_ENABLE;
   spi_setup_struct.refFreq = ICM_REFFREQ;
   spi_setup_struct.baudrate = ICM_BAUDRATE;
+  spi_setup_struct.read_baudrate = ICM_READ_BAUDRATE;
   spi_setup_struct.databits = ICM_DATABITS;
   spi_setup_struct.master = ICM_MASTER;
   spi_setup_struct.msbf = ICM_MSBF;
@@ -131,12 +138,104 @@ void icm20648_open(void){
 
   spi_setup_struct.tx_pin_en = true;
   spi_setup_struct.rx_pin_en = true;
-  spi_setup_struct.cs_pin_en = false;
+  spi_setup_struct.cs_pin_en = ICM_AUTOCSENABLE;
   spi_setup_struct.sclk_pin_en = true;
 
+  spi_setup_struct.cs_port = USART_CS_PORT;
+  spi_setup_struct.cs_pin = USART_CS_PIN;
+  spi_setup_struct.double_buffer_en = ICM_DOUBLE_BUFFER;
+
+  spi_setup_struct.ldma_en = ICM_LDMA_ENABLE;
+  spi_setup_struct.ldma_tx_ch = ICM_LDMA_TX_CH;
+  spi_setup_struct.ldma_rx_ch = ICM_LDMA_RX_CH;
+
+  spi_setup_struct.poll_max_bytes = ICM_POLL_MAX_BYTES;
+
   spi_open(ICM_USART, &spi_setup_struct);
 
-  icm20648_config();
+  init_step_cb = step_cb;
+  init_ready_cb = ready_cb;
+  init_error_cb = error_cb;
+  init_index = 0;
+  init_retries = 0;
+  init_checkTrue = false;
+  icm20648_init_step();
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Runs the next step of the icm20648 bring-up sequence
+ *
+ * @details
+ *  Each step of icm_init_table starts one transfer whose callback is the step
+ *  callback given to icm20648_open(), so the sequence moves on as each transfer
+ *  finishes and the CPU is free in between. A check step reads a register and
+ *  compares it in the next call. WHO_AM_I does not answer until the sensor has
+ *  finished powering up, so a failed check is read again ICM_RETRY_DELAY ms
+ *  later. The wait runs on timer_delay_event(), which adds the step callback
+ *  back to the scheduler, so nothing blocks while the sensor powers up. After
+ *  ICM_STARTUP_RETRIES failed tries the error callback is added instead and
+ *  the sequence stops. A check of a register written through
+ *  icm20648_write_reg() compares against its shadow copy, other checks
+ *  against the table. Writes go through icm20648_write_reg() so bank switches
+ *  are only made when needed. The ready callback is added to the scheduler at
+ *  the end.
+ *
+ * @note
+ *  Must be called from the step callback given to icm20648_open()
+ *
+ ******************************************************************************/
+void icm20648_init_step(void){
+  const ICM_INIT_STEP *step = &icm_init_table[init_index];
+  uint32_t expected;
+
+  if(init_checkTrue){
+      init_checkTrue = false;
+      expected = step->data;
+      if(shadow_valid[step->bank][step->reg / 8] & (1 << (step->reg % 8))){
+          expected = shadow[step->bank][step->reg];
+      }
+      if(usart_read_result == expected){
+          init_index++;
+          init_retries = 0;
+      } else {
+          init_retries++;
+          if(init_retries >= ICM_STARTUP_RETRIES){
+              add_scheduled_event(init_error_cb);
+          } else {
+              timer_delay_event(ICM_RETRY_DELAY, init_step_cb);
+          }
+          return;
+      }
+      step = &icm_init_table[init_index];
+  }
+
+  switch(step->op){
+    case ICM_STEP_CHECK:
+      init_checkTrue = true;
+      icm20648_select_bank(step->bank);
+      icm20648_read(step->reg, 1, init_step_cb);
+      break;
+
+    case ICM_STEP_WRITE:
+      init_index++;
+      icm20648_write_reg(step->bank, step->reg, step->data, init_step_cb);
+      break;
+
+    case ICM_STEP_BANK:
+      init_index++;
+      icm20648_select_bank(step->bank);
+      add_scheduled_event(init_step_cb);
+      break;
+
+    case ICM_STEP_END:
+      add_scheduled_event(init_ready_cb);
+      break;
+
+    default:
+      EFM_ASSERT(false);
+      break;
+  }
 }
 
 
@@ -166,6 +265,629 @@ void icm20648_read(uint32_t reg, uint32_t bytes, uint32_t callback){
   spi_start(ICM_USART, true, bytes, reg, callback, &usart_read_result, NOP);
 }
 
+/***************************************************************************//**
+ * @brief
+ *  Starts a read of a block of registers into a caller's buffer
+ *
+ * @details
+ *  This function calls spi_transfer so that any number of registers starting
+ *  at reg are read in one chip select window, using the register address auto
+ *  increment of the icm20648
+ *
+ * @note
+ *  SPI peripheal must be set up with spi_open() before a read can be done
+ *
+ * @param [in] reg
+ *  Indicates the first register address to be read
+ *
+ * @param [in] buf
+ *  Buffer the bytes read are stored in, must hold at least bytes bytes
+ *
+ * @param [in] bytes
+ *  Defines the number of bytes being read
+ *
+ * @param [in] callback
+ *  Specifies the callback that is added to the scheduler after the state machine
+ *  is complete
+ *
+ ******************************************************************************/
+void icm20648_read_buffer(uint32_t reg, uint8_t *buf, uint32_t bytes, uint32_t callback){
+  spi_transfer(ICM_USART, true, reg, NULL, buf, bytes, callback);
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Starts reading a block of registers every time a PRS channel fires
+ *
+ * @details
+ *  This function calls spi_stream_start so the reads are started by the LDMA
+ *  with no code running, and the callback is only posted once samples reads
+ *  have been stored. icm20648_stream_frames() returns the finished reads.
+ *
+ * @note
+ *  Needs ICM_LDMA_ENABLE and ICM_AUTOCSENABLE
+ *
+ * @param [in] prs_ch
+ *  PRS channel that triggers each read
+ *
+ * @param [in] reg
+ *  Indicates the first register address to be read
+ *
+ * @param [in] bytes
+ *  Defines the number of bytes read each time
+ *
+ * @param [in] ring
+ *  Buffer of 2 * samples * SPI_STREAM_FRAME(bytes) bytes
+ *
+ * @param [in] samples
+ *  Reads between callbacks
+ *
+ * @param [in] callback
+ *  Specifies the callback that is added to the scheduler each time samples
+ *  reads are done
+ *
+ ******************************************************************************/
+void icm20648_stream_start(uint32_t prs_ch, uint32_t reg, uint32_t bytes,
+    uint8_t *ring, uint32_t samples, uint32_t callback){
+  icm20648_select_bank(0);
+  spi_stream_start(ICM_USART, prs_ch, reg, bytes, ring, samples, callback);
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Stops the reads started by icm20648_stream_start()
+ *
+ ******************************************************************************/
+void icm20648_stream_stop(void){
+  spi_stream_stop(ICM_USART);
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Returns the reads finished since the last stream callback
+ *
+ * @details
+ *  The reads are SPI_STREAM_FRAME(bytes) apart and the register data of each
+ *  one starts at its second byte.
+ *
+ ******************************************************************************/
+const uint8_t *icm20648_stream_frames(void){
+  return spi_stream_frames(ICM_USART);
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Switches REG_BANK_SEL to a register bank
+ *
+ * @details
+ *  The bank last written is tracked, so the write is only made when the bank
+ *  changes. A skipped write is counted by icm20648_elided_count().
+ *
+ * @note
+ *  Every access to the icm20648 must go through this driver for the tracked
+ *  bank to stay right
+ *
+ * @param [in] bank
+ *  Register bank, 0 to 3
+ *
+ ******************************************************************************/
+void icm20648_select_bank(uint32_t bank){
+  EFM_ASSERT(bank < ICM_NUM_BANKS);
+
+  if(bank == current_bank){
+      elided_count++;
+      return;
+  }
+  icm20648_write(REG_BANK_SEL_REG, REG_BANK_SEL_BYTES, bank << REG_BANK_SHIFT, NOP);
+  current_bank = bank;
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Writes a configuration register unless it already holds the value
+ *
+ * @details
+ *  A shadow copy of every register written through this function is kept. If
+ *  the shadow copy already holds data and the SPI is idle nothing is sent and
+ *  only the callback is added to the scheduler, otherwise the bank is
+ *  selected and the register is written. The write is not skipped while
+ *  transfers are queued so its callback still comes after theirs, which the
+ *  bring-up sequence and the users of icm20648_modify_reg() rely on.
+ *
+ * @note
+ *  Only for configuration registers, which the icm20648 never changes itself.
+ *  Strobe and self clearing writes, see icm20648_uncached(), are always sent
+ *  and not shadowed, and DEVICE_RESET forgets every shadow copy.
+ *
+ * @param [in] bank
+ *  Register bank of the register
+ *
+ * @param [in] reg
+ *  Register address to be written
+ *
+ * @param [in] data
+ *  Value to be written
+ *
+ * @param [in] callback
+ *  Specifies the callback that is added to the scheduler after the write
+ *
+ ******************************************************************************/
+void icm20648_write_reg(uint32_t bank, uint32_t reg, uint8_t data, uint32_t callback){
+  EFM_ASSERT(bank < ICM_NUM_BANKS && reg < ICM_NUM_REGS);
+
+  if(icm20648_uncached(bank, reg, data)){
+      icm20648_select_bank(bank);
+      icm20648_write(reg, 1, data, callback);
+      if(reg == PWR_MGMT_1_REG){
+          memset(shadow_valid, 0, sizeof(shadow_valid));
+          current_bank = 0;
+      }
+      return;
+  }
+
+  if((shadow_valid[bank][reg / 8] & (1 << (reg % 8))) && (shadow[bank][reg] == data)
+      && !spi_get_busy(ICM_USART)){
+      elided_count++;
+      add_scheduled_event(callback);
+      return;
+  }
+
+  icm20648_select_bank(bank);
+  icm20648_write(reg, 1, data, callback);
+  shadow[bank][reg] = data;
+  shadow_valid[bank][reg / 8] |= 1 << (reg % 8);
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Changes some bits of a configuration register without reading it
+ *
+ * @details
+ *  The new value is made from the shadow copy, so the read of a read modify
+ *  write is never sent. Each elided read is counted by icm20648_elided_count().
+ *
+ * @note
+ *  The register must have been written with icm20648_write_reg() first, or be
+ *  one whose every bit is set here
+ *
+ * @param [in] bank
+ *  Register bank of the register
+ *
+ * @param [in] reg
+ *  Register address to be changed
+ *
+ * @param [in] mask
+ *  Bits that are changed
+ *
+ * @param [in] data
+ *  New value of the bits in mask
+ *
+ * @param [in] callback
+ *  Specifies the callback that is added to the scheduler after the write
+ *
+ ******************************************************************************/
+void icm20648_modify_reg(uint32_t bank, uint32_t reg, uint8_t mask, uint8_t data,
+    uint32_t callback){
+  uint8_t value = 0;
+
+  EFM_ASSERT(bank < ICM_NUM_BANKS && reg < ICM_NUM_REGS);
+
+  if(shadow_valid[bank][reg / 8] & (1 << (reg % 8))){
+      value = shadow[bank][reg];
+      elided_count++;
+  } else {
+      EFM_ASSERT(mask == MASK);
+  }
+  icm20648_write_reg(bank, reg, (value & ~mask) | (data & mask), callback);
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Returns how many bank switches, writes and reads have been skipped
+ *
+ ******************************************************************************/
+uint32_t icm20648_elided_count(void){
+  return elided_count;
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Sets the icm20648 to raise its INT pin on motion
+ *
+ * @details
+ *  The wake on motion logic in bank 2 is turned on using the threshold written
+ *  in the bring-up sequence, and INT is set active high and latched until any
+ *  register is read. Reading a sample after the INT event so clears the
+ *  interrupt with no extra transfer. The writes are queued back to back so
+ *  this returns right away.
+ *
+ * @note
+ *  The INT pin interrupt is opened with gpio_icm_int_open()
+ *
+ ******************************************************************************/
+void icm20648_wom_open(void){
+  icm20648_write_reg(2, ACCEL_INTEL_CTRL_REG, ACCEL_INTEL_CTRL_DATA, NOP);
+  icm20648_write_reg(0, INT_PIN_CFG_REG, INT_PIN_CFG_DATA, NOP);
+  icm20648_write_reg(0, INT_ENABLE_REG, INT_ENABLE_WOM, NOP);
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Sets the output data rate of the accelerometer
+ *
+ * @details
+ *  The rate is set with the 12 bit ACCEL_SMPLRT_DIV divider of the 1125 Hz
+ *  base rate, so the rate used is the closest one at or above hz. Both divider
+ *  registers are in bank 2 and unchanged halves are not rewritten.
+ *
+ * @param [in] hz
+ *  Output data rate in Hz, 1 to 1125
+ *
+ ******************************************************************************/
+void icm20648_set_accel_odr(uint32_t hz){
+  uint32_t div;
+
+  EFM_ASSERT(hz > 0 && hz <= ACCEL_BASE_ODR);
+
+  div = ACCEL_BASE_ODR / hz - 1;
+  if(div > ACCEL_SMPLRT_DIV_MAX){
+      div = ACCEL_SMPLRT_DIV_MAX;
+  }
+  icm20648_write_reg(2, ACCEL_SMPLRT_DIV_1_REG, div >> EIGHT, NOP);
+  icm20648_write_reg(2, ACCEL_SMPLRT_DIV_2_REG, div & MASK, NOP);
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Sets the output data rate of the gyro
+ *
+ * @details
+ *  The same as icm20648_set_accel_odr() but with the 8 bit GYRO_SMPLRT_DIV
+ *  divider of the 1100 Hz gyro base rate.
+ *
+ * @param [in] hz
+ *  Output data rate in Hz, 5 to 1100
+ *
+ ******************************************************************************/
+void icm20648_set_gyro_odr(uint32_t hz){
+  uint32_t div;
+
+  EFM_ASSERT(hz > 0 && hz <= GYRO_BASE_ODR);
+
+  div = GYRO_BASE_ODR / hz - 1;
+  if(div > GYRO_SMPLRT_DIV_MAX){
+      div = GYRO_SMPLRT_DIV_MAX;
+  }
+  icm20648_write_reg(2, GYRO_SMPLRT_DIV_REG, div, NOP);
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Moves the icm20648 to one of its power modes
+ *
+ * @details
+ *  ICM_POWER_LOW is the mode set by the bring-up sequence. ICM_POWER_SLEEP
+ *  stops both sensors but keeps every register, so waking up is only the
+ *  PWR_MGMT_1 write. ICM_POWER_LOW_NOISE turns the gyro on and runs from the
+ *  PLL, which costs the most but gives the cleanest data. PWR_MGMT_1 is
+ *  written first when waking and last when going to sleep so the other
+ *  writes always reach an awake sensor. Registers already holding the
+ *  value are skipped by the shadow cache, so a mode that does not change
+ *  costs no transfers.
+ *
+ * @param [in] mode
+ *  Power mode to move to
+ *
+ ******************************************************************************/
+void icm20648_set_power_mode(ICM_POWER_MODE mode){
+  switch(mode){
+    case ICM_POWER_SLEEP:
+      icm20648_write_reg(0, PWR_MGMT_2_REG, PWR_MGMT_2_ALL_OFF, NOP);
+      icm20648_write_reg(0, PWR_MGMT_1_REG, PWR_MGMT_1_SLEEP | PWR_MGMT_1_TEMP_DIS, NOP);
+      break;
+    case ICM_POWER_LOW:
+      icm20648_write_reg(0, PWR_MGMT_1_REG, PWR_MGMT_1_LP_EN | PWR_MGMT_1_TEMP_DIS, NOP);
+      icm20648_write_reg(0, LP_CONFIG_REG, LP_CONFIG_DATA, NOP);
+      icm20648_write_reg(0, PWR_MGMT_2_REG, PWR_MGMT_2_DATA, NOP);
+      break;
+    case ICM_POWER_LOW_NOISE:
+      icm20648_write_reg(0, PWR_MGMT_1_REG, PWR_MGMT_1_CLK_AUTO | PWR_MGMT_1_TEMP_DIS, NOP);
+      icm20648_write_reg(0, LP_CONFIG_REG, LP_CONFIG_NONE, NOP);
+      icm20648_write_reg(0, PWR_MGMT_2_REG, PWR_MGMT_2_ALL_ON, NOP);
+      break;
+    default:
+      EFM_ASSERT(false);
+      break;
+  }
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Sets the full scale range and low pass filter of the accelerometer
+ *
+ * @param [in] range
+ *  Full scale range, ICM_ACCEL_2G to ICM_ACCEL_16G
+ *
+ * @param [in] dlpf
+ *  ACCEL_DLPFCFG setting 0 to 7, or ICM_DLPF_OFF to bypass the filter
+ *
+ ******************************************************************************/
+void icm20648_set_accel_config(ICM_ACCEL_RANGE range, uint32_t dlpf){
+  uint8_t config;
+
+  config = range << ACCEL_FS_SEL_SHIFT;
+  if(dlpf != ICM_DLPF_OFF){
+      EFM_ASSERT(dlpf <= ACCEL_DLPFCFG_MAX);
+      config |= (dlpf << ACCEL_DLPFCFG_SHIFT) | ACCEL_FCHOICE;
+  }
+  icm20648_write_reg(2, ACCEL_CONFIG_REG, config, NOP);
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Sets the icm20648 to raise its INT pin every time a new sample is ready
+ *
+ * @details
+ *  INT is latched until any register is read, so the sample read started by
+ *  the INT event also clears it. The INT pin interrupt is opened with
+ *  gpio_icm_int_open() and its callback should call icm20648_drdy_read().
+ *
+ ******************************************************************************/
+void icm20648_drdy_start(void){
+  drdy_front = 0;
+  drdy_readTrue = false;
+  icm20648_write_reg(0, INT_PIN_CFG_REG, INT_PIN_CFG_DATA, NOP);
+  icm20648_write_reg(0, INT_ENABLE_1_REG, INT_ENABLE_1_RDY, NOP);
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Stops the data ready interrupt
+ *
+ ******************************************************************************/
+void icm20648_drdy_stop(void){
+  icm20648_write_reg(0, INT_ENABLE_1_REG, 0, NOP);
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Reads a new sample into the back half of the sample double buffer
+ *
+ * @details
+ *  The burst lands straight in the icm20648_sample_t that is not published,
+ *  so the sample the application holds is never written while it is used.
+ *  The callback should call icm20648_drdy_publish().
+ *
+ * @param [in] callback
+ *  Specifies the callback that is added to the scheduler after the read
+ *
+ ******************************************************************************/
+void icm20648_drdy_read(uint32_t callback){
+  icm20648_select_bank(0);
+  drdy_readTrue = true;
+  icm20648_read_buffer(ACCEL_XOUT_H_REG, (uint8_t *)&drdy_buf[drdy_front ^ 1],
+      ICM_SAMPLE_BYTES, callback);
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Publishes the sample read by icm20648_drdy_read()
+ *
+ * @details
+ *  Every value of the back buffer is swapped in place from the big endian
+ *  order of the sensor, then the back buffer becomes the front one. The
+ *  application reads the sample through the returned pointer with no copy.
+ *  A publish with no new read behind it returns the front sample again, since
+ *  the back buffer then holds an already swapped sample.
+ *
+ * @return
+ *  Newest sample, valid until the next icm20648_drdy_publish()
+ *
+ ******************************************************************************/
+const icm20648_sample_t *icm20648_drdy_publish(void){
+  uint16_t *value = (uint16_t *)&drdy_buf[drdy_front ^ 1];
+
+  if(!drdy_readTrue){
+      return &drdy_buf[drdy_front];
+  }
+  drdy_readTrue = false;
+  for(int i = 0; i < ICM_SAMPLE_BYTES / 2; i++){
+      value[i] = (value[i] >> EIGHT) | (value[i] << EIGHT);
+  }
+  drdy_front ^= 1;
+  return &drdy_buf[drdy_front];
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Starts a read of every accelerometer, gyroscope and temperature register
+ *
+ * @details
+ *  The 14 bytes from ACCEL_XOUT_H to TEMP_OUT_L are read in one chip select
+ *  window, so a whole sample costs one transfer and one callback and all of
+ *  its values come from the same sensor update. The callback should call
+ *  icm20648_get_sample().
+ *
+ * @param [in] callback
+ *  Specifies the callback that is added to the scheduler after the read
+ *
+ ******************************************************************************/
+void icm20648_read_sample(uint32_t callback){
+  icm20648_select_bank(0);
+  icm20648_read_buffer(ACCEL_XOUT_H_REG, sample_buf, ICM_SAMPLE_BYTES, callback);
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Converts the bytes of the last icm20648_read_sample() into a sample
+ *
+ * @details
+ *  Each value is sent high byte first and is converted to an int16_t here,
+ *  once, so the application never handles the raw bytes.
+ *
+ * @param [out] sample
+ *  Sample the values are stored in
+ *
+ ******************************************************************************/
+void icm20648_get_sample(icm20648_sample_t *sample){
+  int16_t value[ICM_SAMPLE_BYTES / 2];
+
+  for(int i = 0; i < ICM_SAMPLE_BYTES / 2; i++){
+      value[i] = (int16_t)((sample_buf[2 * i] << EIGHT) | sample_buf[2 * i + 1]);
+  }
+  for(int i = 0; i < 3; i++){
+      sample->accel[i] = value[i];
+      sample->gyro[i] = value[i + 3];
+  }
+  sample->temp = value[6];
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Starts the icm20648 storing accelerometer samples in its FIFO
+ *
+ * @details
+ *  The FIFO is reset, set to stream mode and given the accelerometer data,
+ *  then turned on in USER_CTRL. FIFO_RST is a strobe, so it is written
+ *  straight to the SPI every time rather than through the shadow copy. The
+ *  sensor then collects a frame at its own output data rate with no reads
+ *  from the microcontroller, so the sample rate no longer sets how often the
+ *  CPU wakes up. The writes are queued back to back so this returns right
+ *  away.
+ *
+ ******************************************************************************/
+void icm20648_fifo_start(void){
+  fifo_head = 0;
+  fifo_fill = 0;
+  fifo_pending = 0;
+
+  icm20648_write_reg(0, FIFO_EN_2_REG, 0, NOP);
+  icm20648_select_bank(0);
+  icm20648_write(FIFO_RST_REG, 1, FIFO_RST_ALL, NOP);
+  icm20648_write(FIFO_RST_REG, 1, FIFO_RST_NONE, NOP);
+  icm20648_write_reg(0, FIFO_MODE_REG, FIFO_MODE_STREAM, NOP);
+  icm20648_write_reg(0, FIFO_EN_2_REG, FIFO_EN_2_ACCEL, NOP);
+  icm20648_write_reg(0, USER_CTRL_REG, USER_CTRL_FIFO_EN, NOP);
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Stops the icm20648 FIFO
+ *
+ ******************************************************************************/
+void icm20648_fifo_stop(void){
+  icm20648_modify_reg(0, USER_CTRL_REG, USER_CTRL_FIFO_EN, 0, NOP);
+  icm20648_write_reg(0, FIFO_EN_2_REG, 0, NOP);
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Reads how many bytes are waiting in the icm20648 FIFO
+ *
+ * @details
+ *  FIFO_COUNTH and FIFO_COUNTL are read in one transfer so the count cannot
+ *  change between the two halves. The callback should call
+ *  icm20648_fifo_drain().
+ *
+ * @param [in] callback
+ *  Specifies the callback that is added to the scheduler once the count is read
+ *
+ ******************************************************************************/
+void icm20648_fifo_poll(uint32_t callback){
+  icm20648_select_bank(0);
+  icm20648_read_buffer(FIFO_COUNTH_REG, fifo_count_buf, FIFO_COUNT_BYTES, callback);
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Drains the icm20648 FIFO into the sample ring once the watermark is reached
+ *
+ * @details
+ *  If the count read by icm20648_fifo_poll() holds at least
+ *  ICM_FIFO_WATERMARK whole frames, as many as fit in the ring without
+ *  wrapping are read from FIFO_R_W in one burst straight into the ring. The
+ *  callback should call icm20648_fifo_drained().
+ *
+ * @param [in] callback
+ *  Specifies the callback that is added to the scheduler once the burst is done
+ *
+ * @return
+ *  True if a burst was started, false if the watermark was not reached or the
+ *  ring is full
+ *
+ ******************************************************************************/
+bool icm20648_fifo_drain(uint32_t callback){
+  uint32_t frames;
+  uint32_t tail;
+
+  frames = (((fifo_count_buf[0] << EIGHT) | fifo_count_buf[1]) & FIFO_COUNT_MASK)
+      / ICM_FIFO_FRAME_BYTES;
+  if(fifo_pending || (frames < ICM_FIFO_WATERMARK)){
+      return false;
+  }
+
+  tail = (fifo_head + fifo_fill) % ICM_FIFO_RING_FRAMES;
+  if(frames > ICM_FIFO_RING_FRAMES - fifo_fill){
+      frames = ICM_FIFO_RING_FRAMES - fifo_fill;
+  }
+  if(frames > ICM_FIFO_RING_FRAMES - tail){
+      frames = ICM_FIFO_RING_FRAMES - tail;
+  }
+  if(frames == 0){
+      return false;
+  }
+
+  fifo_pending = frames;
+  icm20648_select_bank(0);
+  icm20648_read_buffer(FIFO_R_W_REG, &fifo_ring[tail * ICM_FIFO_FRAME_BYTES],
+      frames * ICM_FIFO_FRAME_BYTES, callback);
+  return true;
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Adds the frames of a finished drain to the sample ring
+ *
+ * @note
+ *  Must be called from the callback given to icm20648_fifo_drain()
+ *
+ * @return
+ *  Frames waiting in the ring
+ *
+ ******************************************************************************/
+uint32_t icm20648_fifo_drained(void){
+  fifo_fill += fifo_pending;
+  fifo_pending = 0;
+  return fifo_fill;
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Takes the oldest frame out of the sample ring
+ *
+ * @param [out] accel
+ *  X, Y and Z of the frame converted from big endian
+ *
+ * @return
+ *  False if the ring is empty
+ *
+ ******************************************************************************/
+bool icm20648_fifo_pop(int16_t accel[3]){
+  const uint8_t *frame;
+
+  if(fifo_fill == 0){
+      return false;
+  }
+
+  frame = &fifo_ring[fifo_head * ICM_FIFO_FRAME_BYTES];
+  for(int i = 0; i < 3; i++){
+      accel[i] = (int16_t)((frame[2 * i] << EIGHT) | frame[2 * i + 1]);
+  }
+  fifo_head = (fifo_head + 1) % ICM_FIFO_RING_FRAMES;
+  fifo_fill--;
+  return true;
+}
+
 /***************************************************************************//**
  * @brief
  *  Starts a write with spi peripheral
@@ -0,0 +1,141 @@
+/**
+ * @file   ldma.c
+ * @brief  Functions to share the LDMA peripheral between the serial drivers
+ *
+ */
+//***********************************************************************************
+// Include files
+//***********************************************************************************
+#include "ldma.h"
+
+//***********************************************************************************
+// private define statements
+//***********************************************************************************
+
+//***********************************************************************************
+// private variables
+//***********************************************************************************
+static LDMA_CHANNEL_STRUCT ldma_channels[LDMA_NUM_CHANNELS];
+static bool ldma_opened = false;
+
+//***********************************************************************************
+// private function prototypes
+//***********************************************************************************
+
+//***********************************************************************************
+// private functions
+//***********************************************************************************
+
+//***********************************************************************************
+// global functions
+//***********************************************************************************
+/***************************************************************************//**
+ * @brief
+ *  Function used to open the LDMA peripheral
+ *
+ * @details
+ *  ldma_open() enables the LDMA clock and initializes the peripheral with the
+ *  default emlib settings. The LDMA is shared by every driver that moves data
+ *  with it, so only the first call does any work.
+ *
+ * @note
+ *  This function is called in the open function of each driver using LDMA
+ *
+ ******************************************************************************/
+void ldma_open(void){
+  LDMA_Init_t ldma_init_struct = LDMA_INIT_DEFAULT;
+
+  if(ldma_opened){
+      return;
+  }
+
+  for(int i = 0; i < LDMA_NUM_CHANNELS; i++){
+      ldma_channels[i].callback = NULL;
+      ldma_channels[i].context = NULL;
+  }
+
+  CMU_ClockEnable(cmuClock_LDMA, true);
+  LDMA_Init(&ldma_init_struct);
+
+  ldma_opened = true;
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Function used to claim an LDMA channel for a driver
+ *
+ * @details
+ *  ldma_channel_open() stores the driver function and the driver state that
+ *  are handed back by LDMA_IRQHandler() once a descriptor with doneIfs set
+ *  finishes on the channel.
+ *
+ * @note
+ *  ldma_open() must be called before a channel is opened
+ *
+ * @param [in] channel
+ *  LDMA channel number being claimed
+ *
+ * @param [in] callback
+ *  Function called from the LDMA interrupt when the channel is done
+ *
+ * @param [in] context
+ *  Pointer passed to the callback, normally the driver's state machine struct
+ *
+ ******************************************************************************/
+void ldma_channel_open(uint32_t channel, LDMA_CHANNEL_CB callback, void *context){
+  EFM_ASSERT(ldma_opened);
+  EFM_ASSERT(channel < LDMA_NUM_CHANNELS);
+  EFM_ASSERT(ldma_channels[channel].callback == NULL);
+
+  ldma_channels[channel].callback = callback;
+  ldma_channels[channel].context = context;
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Lets a PRS channel set its LDMA sync bit
+ *
+ * @details
+ *  ldma_sync_prs_enable() sets the SYNCPRSSETEN bit of the channel so every
+ *  rising edge on PRS channel prs_ch sets bit prs_ch of LDMA SYNC. A SYNC
+ *  descriptor matching on that bit then holds a descriptor chain until the
+ *  next edge, which is how a peripheral event starts a transfer with the
+ *  CPU asleep.
+ *
+ * @param [in] prs_ch
+ *  PRS channel, 0 to 7
+ *
+ ******************************************************************************/
+void ldma_sync_prs_enable(uint32_t prs_ch){
+  EFM_ASSERT(ldma_opened);
+  EFM_ASSERT(prs_ch < LDMA_NUM_SYNC);
+
+  LDMA->CTRL |= (1 << prs_ch) << _LDMA_CTRL_SYNCPRSSETEN_SHIFT;
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Interrupt handler for the LDMA peripheral
+ *
+ * @details
+ *  This function clears the done flags of every channel that has finished and
+ *  calls the callback stored for that channel with ldma_channel_open(). An
+ *  LDMA bus error stops the program since it means a descriptor is wrong.
+ *
+ * @note
+ *  Only descriptors with doneIfs set will set a channel done flag
+ *
+ ******************************************************************************/
+void LDMA_IRQHandler(void){
+  uint32_t int_flag;
+  int_flag = LDMA->IF & LDMA->IEN;
+  LDMA->IFC = int_flag;
+
+  EFM_ASSERT(!(int_flag & LDMA_IF_ERROR));
+
+  for(uint32_t ch = 0; ch < LDMA_NUM_CHANNELS; ch++){
+      if((int_flag & (1 << ch)) && ldma_channels[ch].callback){
+          ldma_channels[ch].callback(ldma_channels[ch].context);
+      }
+  }
+}
@@ -227,3 +227,61 @@ void letimer_start(LETIMER_TypeDef *letimer, bool enable){
 
 }
 
+/***************************************************************************//**
+ * @brief
+ *   Function to put the LETIMER PWM output on a PRS channel
+ *
+ * @details
+ *   letimer_prs_open() routes the OUT0 PWM waveform of the LETIMER to the PRS
+ *   channel. The output goes active on the COMP1 match of every period, so the
+ *   channel sees one rising edge per period whether or not the output pin is
+ *   enabled. Other peripherals can then be started by the LETIMER without an
+ *   interrupt waking the CPU.
+ *
+ * @note
+ *   The PRS signal is asynchronous so it keeps working in EM2
+ *
+ * @param[in] letimer
+ *   Pointer to the base peripheral address of the LETIMER peripheral
+ *
+ * @param[in] prs_ch
+ *   PRS channel the OUT0 waveform is put on
+ *
+ ******************************************************************************/
+void letimer_prs_open(LETIMER_TypeDef *letimer, uint32_t prs_ch){
+    EFM_ASSERT(letimer == LETIMER0);
+
+    CMU_ClockEnable(cmuClock_PRS, true);
+    PRS_SourceAsyncSignalSet(prs_ch, PRS_CH_CTRL_SOURCESEL_LETIMER0,
+        PRS_CH_CTRL_SIGSEL_LETIMER0CH0);
+}
+
+/***************************************************************************//**
+ * @brief
+ *   Function to change the period of a running LETIMER
+ *
+ * @details
+ *   letimer_set_period() loads new COMP0 and COMP1 values. COMP0 is only
+ *   loaded into the counter on an underflow, so the period that is running
+ *   finishes at its old length and the new one starts cleanly after it.
+ *
+ * @param[in] letimer
+ *   Pointer to the base peripheral address of the LETIMER peripheral
+ *
+ * @param[in] period
+ *   New period in seconds
+ *
+ * @param[in] active_period
+ *   New active period in seconds
+ *
+ ******************************************************************************/
+void letimer_set_period(LETIMER_TypeDef *letimer, float period, float active_period){
+    unsigned int period_cnt = period * LETIMER_HZ;
+    unsigned int period_active_cnt = active_period * LETIMER_HZ;
+
+    EFM_ASSERT(period_active_cnt < period_cnt);
+
+    LETIMER_CompareSet(letimer, 0, period_cnt);
+    LETIMER_CompareSet(letimer, 1, period_active_cnt);
+    while(letimer->SYNCBUSY);
+}
@@ -0,0 +1,125 @@
+/**
+ * @file   power_policy.c
+ * @brief  Picks the icm20648 power mode from how busy the board has been
+ *
+ */
+//***********************************************************************************
+// Include files
+//***********************************************************************************
+#include "power_policy.h"
+
+//***********************************************************************************
+// private define statements
+//***********************************************************************************
+
+//***********************************************************************************
+// private variables
+//***********************************************************************************
+static POWER_POLICY_OPEN_STRUCT policy_cfg;
+static ICM_POWER_MODE policy_mode;
+static uint32_t policy_quiet;
+
+//***********************************************************************************
+// private function prototypes
+//***********************************************************************************
+static void power_policy_move(ICM_POWER_MODE mode);
+
+//***********************************************************************************
+// private functions
+//***********************************************************************************
+/***************************************************************************//**
+ * @brief
+ *  Changes the mode and tells the app
+ *
+ ******************************************************************************/
+static void power_policy_move(ICM_POWER_MODE mode){
+  policy_quiet = 0;
+  if(mode != policy_mode){
+      policy_mode = mode;
+      add_scheduled_event(policy_cfg.mode_cb);
+  }
+}
+
+//***********************************************************************************
+// global functions
+//***********************************************************************************
+/***************************************************************************//**
+ * @brief
+ *  Sets up the power policy
+ *
+ * @details
+ *  The mode callback is added to the scheduler right away so the app sets
+ *  the starting profile the same way it sets every later one.
+ *
+ * @param [in] power_policy_open_struct
+ *  Profile of each mode, the thresholds and the mode change event
+ *
+ ******************************************************************************/
+void power_policy_open(const POWER_POLICY_OPEN_STRUCT *power_policy_open_struct){
+  EFM_ASSERT(power_policy_open_struct->start_mode < ICM_POWER_MODES);
+  EFM_ASSERT(power_policy_open_struct->quiet_periods);
+
+  policy_cfg = *power_policy_open_struct;
+  policy_mode = policy_cfg.start_mode;
+  policy_quiet = 0;
+  add_scheduled_event(policy_cfg.mode_cb);
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Moves the mode up or down from the activity of the last period
+ *
+ * @details
+ *  Activity at or above active_threshold moves up one mode at once, so a
+ *  board that starts moving gets full rate data within a period or two.
+ *  Moving down takes quiet_periods quiet periods in a row, so a short pause
+ *  does not drop the rate. A sleeping sensor has no data to judge by, so
+ *  each period in ICM_POWER_SLEEP is followed by one period of
+ *  ICM_POWER_LOW to look, and a single quiet period sends it back to sleep.
+ *  The frames of a period are drained at the start of the next one, so the
+ *  call at the end of that drain judges the look period itself.
+ *
+ * @note
+ *  Called once per LETIMER0 period, once the FIFO drain it starts is over
+ *
+ * @param [in] activity
+ *  Largest activity in the last period, from gesture_take_activity()
+ *
+ ******************************************************************************/
+void power_policy_update(uint32_t activity){
+  if(policy_mode == ICM_POWER_SLEEP){
+      power_policy_move(ICM_POWER_LOW);
+      policy_quiet = policy_cfg.quiet_periods - 1;
+      return;
+  }
+
+  if(activity >= policy_cfg.active_threshold){
+      if(policy_mode < ICM_POWER_LOW_NOISE){
+          power_policy_move(policy_mode + 1);
+      }
+      policy_quiet = 0;
+      return;
+  }
+
+  if(++policy_quiet >= policy_cfg.quiet_periods){
+      power_policy_move(policy_mode - 1);
+  }
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Power mode picked by the policy
+ *
+ ******************************************************************************/
+ICM_POWER_MODE power_policy_get_mode(void){
+  return policy_mode;
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Profile of the power mode picked by the policy
+ *
+ ******************************************************************************/
+const POWER_PROFILE *power_policy_get_profile(void){
+  return &policy_cfg.profile[policy_mode];
+}
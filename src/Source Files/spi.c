@@ -14,18 +14,652 @@
 // private define statements
 //***********************************************************************************
 
+#if SPI_STATS_ENABLE
+#define SPI_STAMP(stamp)        ((stamp) = DWT->CYCCNT)
+#define SPI_ISR_ENTER(spi_sm)   (SPI_STAMP((spi_sm)->stamps.isrEntry), (spi_sm)->stamps.isrCalls++, \
+                                 (spi_sm)->stamps.isrActive = true)
+#define SPI_ISR_EXIT(spi_sm)    ((spi_sm)->stamps.isr += DWT->CYCCNT - (spi_sm)->stamps.isrEntry, \
+                                 (spi_sm)->stamps.isrActive = false)
+#else
+#define SPI_STAMP(stamp)
+#define SPI_ISR_ENTER(spi_sm)
+#define SPI_ISR_EXIT(spi_sm)
+#endif
+
 //***********************************************************************************
 // private variables
 //***********************************************************************************
-static SPI_STATE_MACHINE usart_state_struct;
+static const SPI_INSTANCE spi_instances[SPI_NUM_INSTANCES] = {
+#if defined(USART0)
+  [0] = { USART0, cmuClock_USART0, USART0_RX_IRQn, USART0_TX_IRQn,
+         ldmaPeripheralSignal_USART0_TXBL, ldmaPeripheralSignal_USART0_RXDATAV },
+#endif
+#if defined(USART1)
+  [1] = { USART1, cmuClock_USART1, USART1_RX_IRQn, USART1_TX_IRQn,
+         ldmaPeripheralSignal_USART1_TXBL, ldmaPeripheralSignal_USART1_RXDATAV },
+#endif
+#if defined(USART2)
+  [2] = { USART2, cmuClock_USART2, USART2_RX_IRQn, USART2_TX_IRQn,
+         ldmaPeripheralSignal_USART2_TXBL, ldmaPeripheralSignal_USART2_RXDATAV },
+#endif
+#if defined(USART3)
+  [3] = { USART3, cmuClock_USART3, USART3_RX_IRQn, USART3_TX_IRQn,
+         ldmaPeripheralSignal_USART3_TXBL, ldmaPeripheralSignal_USART3_RXDATAV },
+#endif
+#if defined(USART4)
+  [4] = { USART4, cmuClock_USART4, USART4_RX_IRQn, USART4_TX_IRQn,
+         ldmaPeripheralSignal_USART4_TXBL, ldmaPeripheralSignal_USART4_RXDATAV },
+#endif
+#if defined(USART5)
+  [5] = { USART5, cmuClock_USART5, USART5_RX_IRQn, USART5_TX_IRQn,
+         ldmaPeripheralSignal_USART5_TXBL, ldmaPeripheralSignal_USART5_RXDATAV },
+#endif
+};
+
+static SPI_STATE_MACHINE usart_state_struct[SPI_NUM_INSTANCES];
+#if SPI_STATS_ENABLE
+static SPI_REG_STATS spi_stats[SPI_STATS_REGISTERS];
+#endif
 
 //***********************************************************************************
 // private function prototypes
 //***********************************************************************************
+static uint32_t spi_instance(USART_TypeDef *usart);
+static void spi_ldma_start(SPI_STATE_MACHINE *spi_sm);
+static void spi_done(SPI_STATE_MACHINE *spi_sm);
+static void spi_begin(SPI_STATE_MACHINE *spi_sm);
+static void spi_enqueue(USART_TypeDef *usart, SPI_TRANSACTION *transaction);
+static void spi_pack(SPI_TRANSACTION *transaction);
+static bool spi_polled(SPI_STATE_MACHINE *spi_sm, SPI_TRANSACTION *transaction);
+static void spi_rx_byte(SPI_STATE_MACHINE *spi_sm, uint32_t byte);
+static uint32_t spi_tx_byte(SPI_STATE_MACHINE *spi_sm);
+static void spi_tx_data(SPI_STATE_MACHINE *spi_sm);
+#if SPI_STATS_ENABLE
+static void spi_stats_record(SPI_STATE_MACHINE *spi_sm);
+#endif
 
 //***********************************************************************************
 // private functions
 //***********************************************************************************
+/***************************************************************************//**
+ * @brief
+ *  Finds the spi_instances entry of a USART peripheral
+ *
+ * @details
+ *  spi_instance() searches spi_instances for the USART and returns its index,
+ *  which is also the index of its state machine. The search is only done in
+ *  the API functions, the IRQ handlers index their state machine directly.
+ *
+ * @param [in] usart
+ *  Defines the USART peripheral that is being used
+ *
+ ******************************************************************************/
+static uint32_t spi_instance(USART_TypeDef *usart){
+  for(uint32_t i = 0; i < SPI_NUM_INSTANCES; i++){
+      if(spi_instances[i].usart == usart){
+          return i;
+      }
+  }
+  EFM_ASSERT(false);
+  return 0;
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Starts the LDMA channels that move a whole SPI frame
+ *
+ * @details
+ *  spi_ldma_start() builds two linked descriptors per channel. The TX channel
+ *  sends the register address byte and then either the write data or GARBAGEDATA
+ *  for a read. The RX channel throws away the byte clocked in with the address
+ *  and then either stores the read data or throws away the write echo. Only the
+ *  last RX descriptor raises the done interrupt, so the whole frame costs one
+ *  interrupt instead of a TXBL and RXDATAV interrupt per byte. The data
+ *  descriptors point straight at the caller's buffers.
+ *
+ * @note
+ *  The RX channel is started before the TX channel so no received byte can be
+ *  missed
+ *
+ * @param [in] spi_sm
+ *  SPI_STATE_MACHINE *spi_sm which holds variables needed to use the state
+ *  machine
+ *
+ ******************************************************************************/
+static void spi_ldma_start(SPI_STATE_MACHINE *spi_sm){
+  LDMA_TransferCfg_t tx_cfg = LDMA_TRANSFER_CFG_PERIPHERAL(spi_sm->ldmaTxSignal);
+  LDMA_TransferCfg_t rx_cfg = LDMA_TRANSFER_CFG_PERIPHERAL(spi_sm->ldmaRxSignal);
+  LDMA_Descriptor_t tx_head = LDMA_DESCRIPTOR_LINKREL_M2P_BYTE(&spi_sm->header,
+      &spi_sm->usart->TXDATA, 1, 1);
+  LDMA_Descriptor_t tx_data = LDMA_DESCRIPTOR_SINGLE_M2P_BYTE(spi_sm->txBuf,
+      &spi_sm->usart->TXDATA, spi_sm->bytes);
+  LDMA_Descriptor_t rx_head = LDMA_DESCRIPTOR_LINKREL_P2M_BYTE(&spi_sm->usart->RXDATA,
+      &spi_sm->rxDiscard, 1, 1);
+  LDMA_Descriptor_t rx_data = LDMA_DESCRIPTOR_SINGLE_P2M_BYTE(&spi_sm->usart->RXDATA,
+      spi_sm->rxBuf, spi_sm->bytes);
+
+  spi_sm->header = spi_sm->registerAddress
+      | ((spi_sm->readTrue ? READBIT : WRITEBIT) << SHIFTBY7);
+  spi_sm->txDummy = GARBAGEDATA;
+
+  if(spi_sm->readTrue){
+      tx_data.xfer.srcAddr = (uint32_t)&spi_sm->txDummy;
+      tx_data.xfer.srcInc = ldmaCtrlSrcIncNone;
+  } else {
+      rx_data.xfer.dstAddr = (uint32_t)&spi_sm->rxDiscard;
+      rx_data.xfer.dstInc = ldmaCtrlDstIncNone;
+  }
+  tx_head.xfer.doneIfs = false;
+  tx_data.xfer.doneIfs = false;
+  rx_head.xfer.doneIfs = false;
+  rx_data.xfer.doneIfs = true;
+
+  spi_sm->ldmaTxDesc[0] = tx_head;
+  spi_sm->ldmaTxDesc[1] = tx_data;
+  spi_sm->ldmaRxDesc[0] = rx_head;
+  spi_sm->ldmaRxDesc[1] = rx_data;
+
+  spi_sm->usart->CMD = USART_CMD_CLEARRX;
+  LDMA_StartTransfer(spi_sm->ldmaRxCh, &rx_cfg, &spi_sm->ldmaRxDesc[0]);
+  LDMA_StartTransfer(spi_sm->ldmaTxCh, &tx_cfg, &spi_sm->ldmaTxDesc[0]);
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Ends a transfer once the last byte has been clocked
+ *
+ * @details
+ *  spi_done() is shared by the RXDATAV, TXC and LDMA endings of the state
+ *  machine. If the transfer came from spi_start() the bytes read are packed
+ *  into storeData by spi_pack(), which is only done once here instead of a
+ *  shift and OR per byte in the ISR. Then the RX interrupts are disabled, chip
+ *  select is set to high unless the USART drives it, the callback is added to
+ *  the scheduler and the transfer is taken off the queue. If another transfer
+ *  is waiting it is started right away, otherwise the sleep mode is unblocked
+ *  and the busy bit is set to false.
+ *
+ * @param [in] spi_sm
+ *  SPI_STATE_MACHINE *spi_sm which holds variables needed to use the state
+ *  machine
+ *
+ ******************************************************************************/
+static void spi_done(SPI_STATE_MACHINE *spi_sm){
+  SPI_TRANSACTION *transaction = &spi_sm->queue[spi_sm->queueHead];
+
+  SPI_STAMP(spi_sm->stamps.lastByte);
+  spi_pack(transaction);
+
+  if(!spi_sm->ldmaTrue){
+      spi_sm->usart->IEN &= ~(USART_IEN_RXDATAV | USART_IEN_RXFULL);
+  }
+  if(!spi_sm->autoCsTrue){
+      GPIO_PinOutSet(spi_sm->cs_port, spi_sm->cs_pin);
+  }
+  add_scheduled_event(transaction->callback);
+  SPI_STAMP(spi_sm->stamps.dispatch);
+#if SPI_STATS_ENABLE
+  if(spi_sm->stamps.isrActive){
+      //the interrupt up to here belongs to this transfer, the rest to the next
+      spi_sm->stamps.isr += spi_sm->stamps.dispatch - spi_sm->stamps.isrEntry;
+      spi_sm->stamps.isrEntry = spi_sm->stamps.dispatch;
+  }
+  spi_stats_record(spi_sm);
+#endif
+
+  spi_sm->queueHead = (spi_sm->queueHead + 1) % SPI_QUEUE_DEPTH;
+  spi_sm->queueCount--;
+
+  if(spi_sm->queueCount){
+      spi_begin(spi_sm);
+  } else {
+      sleep_unblock_mode(SPI_SLEEP_BLOCK);
+      spi_sm->busy = false;
+  }
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Loads the state machine with the transfer at the head of the queue
+ *
+ * @details
+ *  spi_begin() copies the transfer at the head of the queue into the state
+ *  machine struct, selects the read or write clock, sets chip select to low
+ *  unless the USART drives it, and
+ *  defines the current state of the state machine to be sendRA. Then the
+ *  interrupts TXBL and RXDATAV are enabled, TXBL and RXFULL in double buffered
+ *  mode, or if the driver was opened with ldma_en the LDMA channels are
+ *  started to move the whole frame.
+ *
+ * @note
+ *  Called from spi_enqueue() when the driver is idle and from spi_done() to
+ *  chain to the next transfer
+ *
+ * @param [in] spi_sm
+ *  SPI_STATE_MACHINE *spi_sm which holds variables needed to use the state
+ *  machine
+ *
+ ******************************************************************************/
+static void spi_begin(SPI_STATE_MACHINE *spi_sm){
+  SPI_TRANSACTION *transaction = &spi_sm->queue[spi_sm->queueHead];
+
+  spi_sm->readTrue = transaction->readTrue;
+  spi_sm->registerAddress = transaction->registerAddress;
+  spi_sm->callback = transaction->callback;
+  spi_sm->bytes = transaction->bytes;
+  if(transaction->packedTrue){
+      spi_sm->txBuf = transaction->packBytes;
+      spi_sm->rxBuf = transaction->packBytes;
+  } else {
+      spi_sm->txBuf = transaction->txBuf;
+      spi_sm->rxBuf = transaction->rxBuf;
+  }
+  spi_sm->bitBucketTrue = true;
+  spi_sm->readCounter = transaction->bytes;
+  spi_sm->writeCounter = transaction->bytes;
+#if SPI_STATS_ENABLE
+  spi_sm->stamps.enqueue = transaction->enqueueStamp;
+  spi_sm->stamps.isr = 0;
+  spi_sm->stamps.isrCalls = 0;
+#endif
+
+  //the bus is idle between frames so the clock can be changed here
+  if(spi_sm->readTrue){
+      spi_sm->usart->CLKDIV = spi_sm->clkdivRead;
+  } else {
+      spi_sm->usart->CLKDIV = spi_sm->clkdivWrite;
+  }
+
+  if(!spi_sm->autoCsTrue){
+      GPIO_PinOutClear(spi_sm->cs_port, spi_sm->cs_pin);
+  }
+  SPI_STAMP(spi_sm->stamps.csAssert);
+  spi_sm->currentState = sendRA;
+
+  if(spi_sm->ldmaTrue){
+      SPI_STAMP(spi_sm->stamps.firstByte);
+      spi_ldma_start(spi_sm);
+  } else if(spi_sm->doubleTrue){
+      //the echo of a write is never read, so only a read listens to RX
+      spi_sm->usart->CMD = USART_CMD_CLEARRX;
+      spi_sm->usart->IFC = USART_IF_RXFULL;
+      spi_sm->usart->IEN |= USART_IEN_TXBL | (USART_IEN_RXFULL * spi_sm->readTrue);
+  } else {
+      //a write chained from the TXC interrupt can leave its last echo behind
+      spi_sm->usart->CMD = USART_CMD_CLEARRX;
+      spi_sm->usart->IEN |= USART_IEN_TXBL | USART_IEN_RXDATAV;
+  }
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Packs the bytes of a finished spi_start() read into its storeData
+ *
+ * @details
+ *  spi_pack() joins packBytes most significant byte first into storeData, so
+ *  the ISRs only have to store bytes. Buffer transfers and writes are left
+ *  alone.
+ *
+ * @param [in] transaction
+ *  Transfer that has just finished
+ *
+ ******************************************************************************/
+static void spi_pack(SPI_TRANSACTION *transaction){
+  if(transaction->readTrue && transaction->storeData){
+      *(transaction->storeData) = 0;
+      for(uint32_t i = 0; i < transaction->bytes; i++){
+          *(transaction->storeData) = (*(transaction->storeData) << EIGHT)
+              | transaction->packBytes[i];
+      }
+  }
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Moves a short transfer by polling the USART status
+ *
+ * @details
+ *  spi_polled() runs the whole frame in-line without the TXBL and RXDATAV
+ *  interrupts or blocking a sleep mode, which for one or two bytes costs less
+ *  than the interrupt round trips. TX is kept a byte ahead of RX so the frame
+ *  never stalls. With hardware chip select a late TX byte would end the
+ *  frame, so only then is the loop run with interrupts off, until the last
+ *  byte has been written, a byte time or two. Each wait on the USART status
+ *  is bounded by SPI_POLL_TIMEOUT polls so a wedged USART cannot hang the
+ *  caller. TXC is cleared at the end so a later interrupt driven write does
+ *  not see a stale TXC and end early. The callback is still posted to the
+ *  scheduler so the caller cannot tell the two paths apart, and the transfer
+ *  is timed into the statistics like a queued one, with no ISR cycles and no
+ *  wait.
+ *
+ * @note
+ *  Called from spi_enqueue() outside its critical section, with busy set so
+ *  the driver is claimed
+ *
+ * @return
+ *  false if the USART stopped moving bytes, the callback is not posted and
+ *  spi_enqueue() queues the transfer again
+ *
+ * @param [in] spi_sm
+ *  SPI_STATE_MACHINE *spi_sm of the idle USART
+ *
+ * @param [in] transaction
+ *  Transfer to be moved
+ *
+ ******************************************************************************/
+static bool spi_polled(SPI_STATE_MACHINE *spi_sm, SPI_TRANSACTION *transaction){
+  USART_TypeDef *usart = spi_sm->usart;
+  const uint8_t *txBuf = transaction->packedTrue ? transaction->packBytes : transaction->txBuf;
+  uint8_t *rxBuf = transaction->packedTrue ? transaction->packBytes : transaction->rxBuf;
+  uint32_t frameBytes = transaction->bytes + 1;
+  uint32_t sent = 0;
+  uint32_t received = 0;
+  uint32_t timeout = SPI_POLL_TIMEOUT;
+  uint32_t byte;
+  CORE_DECLARE_IRQ_STATE;
+
+#if SPI_STATS_ENABLE
+  //the driver is claimed, so the state machine is free to hold the record
+  SPI_STAMP(spi_sm->stamps.enqueue);
+  spi_sm->stamps.isr = 0;
+  spi_sm->stamps.isrCalls = 0;
+  spi_sm->registerAddress = transaction->registerAddress;
+  spi_sm->bytes = transaction->bytes;
+#endif
+  if(transaction->readTrue){
+      usart->CLKDIV = spi_sm->clkdivRead;
+  } else {
+      usart->CLKDIV = spi_sm->clkdivWrite;
+  }
+  if(!spi_sm->autoCsTrue){
+      GPIO_PinOutClear(spi_sm->cs_port, spi_sm->cs_pin);
+  }
+  usart->CMD = USART_CMD_CLEARRX;
+  SPI_STAMP(spi_sm->stamps.csAssert);
+
+  if(spi_sm->autoCsTrue){
+      CORE_ENTER_CRITICAL();
+  }
+  while(received < frameBytes){
+      if(--timeout == 0){
+          break;
+      }
+      if((sent < frameBytes) && (usart->STATUS & USART_STATUS_TXBL)){
+          if(sent == 0){
+              byte = transaction->registerAddress | (transaction->readTrue << SHIFTBY7);
+          } else if(transaction->readTrue){
+              byte = GARBAGEDATA;
+          } else {
+              byte = txBuf[sent - 1];
+          }
+          usart->TXDATA = byte;
+          if(sent == 0){
+              SPI_STAMP(spi_sm->stamps.firstByte);
+          }
+          sent++;
+          if(sent == frameBytes && spi_sm->autoCsTrue){
+              CORE_EXIT_CRITICAL();
+          }
+          timeout = SPI_POLL_TIMEOUT;
+      }
+      if(usart->STATUS & USART_STATUS_RXDATAV){
+          byte = usart->RXDATA;
+          //the first byte is the echo of the register address
+          if(received && transaction->readTrue){
+              rxBuf[received - 1] = byte;
+          }
+          received++;
+          timeout = SPI_POLL_TIMEOUT;
+      }
+  }
+  if(sent < frameBytes && spi_sm->autoCsTrue){
+      CORE_EXIT_CRITICAL();
+  }
+
+  if(!spi_sm->autoCsTrue){
+      GPIO_PinOutSet(spi_sm->cs_port, spi_sm->cs_pin);
+  }
+  usart->IFC = USART_IF_TXC;
+  if(received < frameBytes){
+      usart->CMD = USART_CMD_CLEARTX | USART_CMD_CLEARRX;
+      EFM_ASSERT(false);
+      return false;
+  }
+  SPI_STAMP(spi_sm->stamps.lastByte);
+  spi_pack(transaction);
+  add_scheduled_event(transaction->callback);
+  SPI_STAMP(spi_sm->stamps.dispatch);
+#if SPI_STATS_ENABLE
+  spi_stats_record(spi_sm);
+#endif
+  return true;
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Adds a transfer to the queue and starts it if the driver is idle
+ *
+ * @details
+ *  spi_enqueue() copies the transfer into the next free queue slot inside a
+ *  critical section so it cannot race the ISR taking a transfer off the queue.
+ *  If nothing was in flight the sleep mode (EM2) is blocked, the busy bit is
+ *  set to true and the transfer is started. Otherwise the transfer is started
+ *  by spi_done() once the ones ahead of it have finished, so the caller never
+ *  waits on the bus. A transfer no longer than poll_max_bytes made while the
+ *  driver is idle is instead finished in-line by spi_polled(). The driver is
+ *  claimed with busy under the lock and the frame is moved with interrupts
+ *  on, transfers queued by ISRs in the meantime are started after it. If the
+ *  polled frame times out it is queued like any other transfer and moved
+ *  again by the interrupts, so the caller still gets its callback.
+ *
+ * @note
+ *  The queue filling up means transfers are being added faster than the bus
+ *  can move them, so SPI_QUEUE_DEPTH must be raised
+ *
+ * @param [in] usart
+ *  Defines the USART peripheral that is being used
+ *
+ * @param [in] transaction
+ *  Transfer to be copied into the queue
+ *
+ ******************************************************************************/
+static void spi_enqueue(USART_TypeDef *usart, SPI_TRANSACTION *transaction){
+  SPI_STATE_MACHINE *spi_sm = &usart_state_struct[spi_instance(usart)];
+  uint32_t slot;
+
+  EFM_ASSERT(usart == spi_sm->usart);
+  if(spi_sm->ldmaTrue){
+      EFM_ASSERT(transaction->bytes <= SPI_LDMA_MAX_BYTES);
+  }
+
+  CORE_DECLARE_IRQ_STATE;
+  CORE_ENTER_CRITICAL();
+
+  if(!spi_sm->busy && (transaction->bytes <= spi_sm->pollMaxBytes)){
+      //nothing is queued, so finishing in-line cannot reorder transfers
+      spi_sm->busy = true;
+      CORE_EXIT_CRITICAL();
+
+      if(spi_polled(spi_sm, transaction)){
+          CORE_ENTER_CRITICAL();
+          if(spi_sm->queueCount){
+              sleep_block_mode(SPI_SLEEP_BLOCK);
+              spi_begin(spi_sm);
+          } else {
+              spi_sm->busy = false;
+          }
+          CORE_EXIT_CRITICAL();
+          return;
+      }
+
+      //the frame timed out, it is queued below so its callback still comes
+      CORE_ENTER_CRITICAL();
+      spi_sm->busy = false;
+  }
+
+  if(spi_sm->queueCount == SPI_QUEUE_DEPTH){
+      CORE_EXIT_CRITICAL();
+      EFM_ASSERT(false);
+      return;
+  }
+
+  slot = (spi_sm->queueHead + spi_sm->queueCount) % SPI_QUEUE_DEPTH;
+  spi_sm->queue[slot] = *transaction;
+  SPI_STAMP(spi_sm->queue[slot].enqueueStamp);
+  spi_sm->queueCount++;
+  if(spi_sm->queueCount > spi_sm->queueHighWater){
+      spi_sm->queueHighWater = spi_sm->queueCount;
+  }
+
+  if(!spi_sm->busy){
+      sleep_block_mode(SPI_SLEEP_BLOCK);
+      spi_sm->busy = true;
+      spi_begin(spi_sm);
+  }
+
+  CORE_EXIT_CRITICAL();
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Handles one byte taken out of the receive buffer during a read
+ *
+ * @details
+ *  spi_rx_byte() throws away the byte clocked in with the register address and
+ *  stores every byte after it in rxBuf. After all the data has been read the
+ *  state machine is ended with spi_done().
+ *
+ * @param [in] spi_sm
+ *  SPI_STATE_MACHINE *spi_sm which holds variables needed to use the state
+ *  machine
+ *
+ * @param [in] byte
+ *  Byte read from RXDATA or one half of RXDOUBLE
+ *
+ ******************************************************************************/
+static void spi_rx_byte(SPI_STATE_MACHINE *spi_sm, uint32_t byte){
+  if(spi_sm->bitBucketTrue) {
+      spi_sm->bitBucketTrue = false;
+  } else {
+    spi_sm->rxBuf[spi_sm->bytes - spi_sm->readCounter] = byte;
+    spi_sm->readCounter--;
+    if(spi_sm->readCounter == 0){
+        spi_sm->usart->IFC = USART_IEN_TXC;
+        spi_done(spi_sm);
+    }
+  }
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Returns the next data byte to be sent
+ *
+ * @details
+ *  spi_tx_byte() returns GARBAGEDATA for a read or the next byte of txBuf for
+ *  a write and counts it off writeCounter.
+ *
+ * @param [in] spi_sm
+ *  SPI_STATE_MACHINE *spi_sm which holds variables needed to use the state
+ *  machine
+ *
+ ******************************************************************************/
+static uint32_t spi_tx_byte(SPI_STATE_MACHINE *spi_sm){
+  uint32_t byte;
+
+  if(spi_sm->readTrue){
+      byte = GARBAGEDATA;
+  } else {
+      byte = spi_sm->txBuf[spi_sm->bytes - spi_sm->writeCounter];
+  }
+  spi_sm->writeCounter--;
+  return byte;
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Puts the next data bytes in the transmit buffer
+ *
+ * @details
+ *  spi_tx_data() writes two bytes at once through TXDOUBLE in double buffered
+ *  mode when two are left, otherwise one byte through TXDATA. Once everything
+ *  has been written TXBL is disabled, and for a write TXC is enabled so
+ *  usart_txc_sm() can end the state machine.
+ *
+ * @param [in] spi_sm
+ *  SPI_STATE_MACHINE *spi_sm which holds variables needed to use the state
+ *  machine
+ *
+ ******************************************************************************/
+static void spi_tx_data(SPI_STATE_MACHINE *spi_sm){
+  uint32_t first;
+
+  if(spi_sm->doubleTrue && (spi_sm->writeCounter >= 2)){
+      first = spi_tx_byte(spi_sm);
+      spi_sm->usart->TXDOUBLE = first | (spi_tx_byte(spi_sm) << EIGHT);
+  } else {
+      spi_sm->usart->TXDATA = spi_tx_byte(spi_sm);
+  }
+
+  if(spi_sm->writeCounter == 0) {
+      spi_sm->usart->IEN &= ~USART_IEN_TXBL;
+      if(!spi_sm->readTrue){
+          spi_sm->usart->IEN |= USART_IEN_TXC;
+      }
+  }
+}
+
+#if SPI_STATS_ENABLE
+/***************************************************************************//**
+ * @brief
+ *  Adds the timestamps of the finished transfer to the register statistics
+ *
+ * @details
+ *  spi_stats_record() splits the time from enqueue to callback dispatch into
+ *  queue wait, chip select to first byte, the transfer itself and the dispatch,
+ *  and files the total in a log2 histogram for the register address. The
+ *  interrupts taken and bytes moved are summed so the interrupts per byte of
+ *  each mode (ISR, double buffered, LDMA) can be compared on the board.
+ *
+ * @note
+ *  The USART interrupt that ends a transfer is still running when this is
+ *  called, so spi_done() first adds its cycles up to the dispatch and moves
+ *  isrEntry on. The rest of that interrupt, including starting the next
+ *  transfer, is then charged to the next transfer by SPI_ISR_EXIT()
+ *
+ * @param [in] spi_sm
+ *  SPI_STATE_MACHINE *spi_sm which holds the timestamps of the transfer
+ *
+ ******************************************************************************/
+static void spi_stats_record(SPI_STATE_MACHINE *spi_sm){
+  SPI_STAMPS *stamps = &spi_sm->stamps;
+  SPI_REG_STATS *stats = &spi_stats[spi_sm->registerAddress % SPI_STATS_REGISTERS];
+  uint32_t total;
+  uint32_t bucket;
+
+  total = stamps->dispatch - stamps->enqueue;
+
+  if(stats->count == 0 || total < stats->min){
+      stats->min = total;
+  }
+  if(total > stats->max){
+      stats->max = total;
+  }
+  stats->count++;
+  stats->sum += total;
+  stats->waitSum += stamps->csAssert - stamps->enqueue;
+  stats->setupSum += stamps->firstByte - stamps->csAssert;
+  stats->transferSum += stamps->lastByte - stamps->firstByte;
+  stats->dispatchSum += stamps->dispatch - stamps->lastByte;
+  stats->isrSum += stamps->isr;
+  stats->isrCallSum += stamps->isrCalls;
+  stats->byteSum += spi_sm->bytes;
+
+  bucket = total ? (31 - __CLZ(total)) : 0;
+  if(bucket >= SPI_STATS_BUCKETS){
+      bucket = SPI_STATS_BUCKETS - 1;
+  }
+  stats->histogram[bucket]++;
+}
+#endif
 
 //***********************************************************************************
 // global functions
@@ -35,10 +669,18 @@ static SPI_STATE_MACHINE usart_state_struct;
  *  Function used to open the spi peripheral
  *
  * @details
- *  spi_open() enables the usart3 clock, checks the clock configuration, sets
- *  all of the variables in the intitalization struct, and calls the init
- *  function. Then, it sets the route location and enables the pins and clears
- *  the interrupts.
+ *  spi_open() looks up the USART in spi_instances, enables its clock, checks
+ *  the clock configuration, sets all of the variables in the intitalization
+ *  struct, and calls the init function. Then, it sets the route location and
+ *  enables the pins, resets the USART's own state machine and clears the
+ *  interrupts. With autoCsEnable the USART drives chip select with the
+ *  autoCsSetup and autoCsHold timing instead of the driver toggling the GPIO,
+ *  which needs ldma_en, and with double_buffer_en the ISRs move two bytes
+ *  per interrupt. LDMA mode takes the place of double buffered mode when
+ *  both are set. Each USART has its own state machine and queue, so
+ *  transfers on different buses run at the same time. The CLKDIV values of
+ *  the write and read clocks are worked out here once so spi_begin() only
+ *  has to copy one into the USART.
  *
  * @note
  *  This function is called in the icm20648_open() function
@@ -52,12 +694,10 @@ static SPI_STATE_MACHINE usart_state_struct;
  ******************************************************************************/
 void spi_open(USART_TypeDef *usart, SPI_OPEN_STRUCT *spi_settings){
   USART_InitSync_TypeDef usart_init_struct;
+  const SPI_INSTANCE *instance = &spi_instances[spi_instance(usart)];
+  SPI_STATE_MACHINE *spi_sm = &usart_state_struct[spi_instance(usart)];
 
-  if (usart == USART3){
-    CMU_ClockEnable(cmuClock_USART3,true);
-  } else {
-     EFM_ASSERT(false);
-  }
+  CMU_ClockEnable(instance->clock, true);
 
   if((usart->IF & 0x1) == 0){
       usart->IFS = 0x1;
@@ -84,6 +724,14 @@ void spi_open(USART_TypeDef *usart, SPI_OPEN_STRUCT *spi_settings){
 
   USART_InitSync(usart, &usart_init_struct);
 
+  spi_sm->clkdivWrite = usart->CLKDIV;
+  spi_sm->clkdivRead = usart->CLKDIV;
+  if(spi_settings->read_baudrate){
+      USART_BaudrateSyncSet(usart, spi_settings->refFreq, spi_settings->read_baudrate);
+      spi_sm->clkdivRead = usart->CLKDIV;
+      usart->CLKDIV = spi_sm->clkdivWrite;
+  }
+
   usart->ROUTELOC0 = spi_settings->sclk_loc | spi_settings->cs_loc
       | spi_settings->tx_loc | spi_settings->rx_loc;
 
@@ -92,35 +740,67 @@ void spi_open(USART_TypeDef *usart, SPI_OPEN_STRUCT *spi_settings){
       | (USART_ROUTEPEN_TXPEN * spi_settings->tx_pin_en)
       | (USART_ROUTEPEN_RXPEN * spi_settings->rx_pin_en);
 
-  usart_state_struct.busy = false;
+  spi_sm->usart = usart;
+  spi_sm->cs_port = spi_settings->cs_port;
+  spi_sm->cs_pin = spi_settings->cs_pin;
+  spi_sm->autoCsTrue = spi_settings->autoCsEnable;
+  spi_sm->doubleTrue = spi_settings->double_buffer_en && !spi_settings->ldma_en;
+  spi_sm->pollMaxBytes = spi_settings->poll_max_bytes;
+  spi_sm->busy = false;
+  spi_sm->queueHead = 0;
+  spi_sm->queueCount = 0;
+  spi_sm->queueHighWater = 0;
+  spi_sm->ldmaTrue = spi_settings->ldma_en;
+  spi_sm->streamTrue = false;
 
-  usart->IFC = usart->IF;
+  if(spi_settings->ldma_en){
+      spi_sm->ldmaTxCh = spi_settings->ldma_tx_ch;
+      spi_sm->ldmaRxCh = spi_settings->ldma_rx_ch;
+      spi_sm->ldmaTxSignal = instance->ldmaTxSignal;
+      spi_sm->ldmaRxSignal = instance->ldmaRxSignal;
+      ldma_open();
+      ldma_channel_open(spi_settings->ldma_rx_ch, usart_ldma_done_sm, spi_sm);
+  }
 
-  USART_Enable(usart, usartEnable);
+  //AUTOCS drops chip select whenever TX runs dry, so TX must never wait on
+  //an ISR in the middle of a frame. A late TXBL interrupt can starve TX even
+  //in double buffered mode, only the LDMA keeps up, so without it chip
+  //select is driven from cs_port and cs_pin
+  EFM_ASSERT(!spi_settings->autoCsEnable || spi_settings->ldma_en);
+  if(spi_settings->autoCsEnable){
+      EFM_ASSERT(spi_settings->cs_pin_en);
+  }
 
-  if (usart == USART3){
-    NVIC_EnableIRQ(USART3_RX_IRQn);
-    NVIC_EnableIRQ(USART3_TX_IRQn);
-  } else {
-      EFM_ASSERT(false);
+#if SPI_STATS_ENABLE
+  cycle_counter_open();
+#endif
+
+  //TXBL only once both buffer slots are free so TXDOUBLE always fits
+  if(spi_sm->doubleTrue){
+      usart->CTRL |= USART_CTRL_TXBIL;
   }
 
+  usart->IFC = usart->IF;
+
+  USART_Enable(usart, usartEnable);
+
+  NVIC_EnableIRQ(instance->rxIrq);
+  NVIC_EnableIRQ(instance->txIrq);
 }
 
 /***************************************************************************//**
  * @brief
- *  This function opens the spi state machine to begin a read or write of data
+ *  This function queues a read or write of up to four bytes packed in a uint32_t
  *
  * @details
- *  spi_start() checks to make sure spi is not busy and sets all of the variables in
- *  the state machine struct according to the function's input variables. Then
- *  it blocks the correct sleep mode (EM2), sets the busy bit to true, sets
- *  chip select to low, and defines the current state of the state machine to
- *  be sendRA. Finally, the interrupts TXBL and RXDATAV are enabled and the
- *  receive buffer is cleared.
+ *  spi_start() unpacks write_data into the queued transfer's own buffer, most
+ *  significant byte first. For a read the bytes are received into the same
+ *  buffer and packed into storeData once the transfer is done. The function
+ *  returns as soon as the transfer is queued.
  *
  * @note
- *  This function must be called after spi_open
+ *  This function must be called after spi_open. spi_transfer() should be used
+ *  for anything longer than four bytes.
  *
  * @param [in] usart
  *  Defines the USART peripheral that is being used
@@ -149,55 +829,367 @@ void spi_open(USART_TypeDef *usart, SPI_OPEN_STRUCT *spi_settings){
 void spi_start(USART_TypeDef *usart, bool readTrue, uint32_t bytes,
                uint32_t registerAddress, uint32_t callback, uint32_t *storeData,
                uint32_t write_data){
+  SPI_TRANSACTION transaction;
+
+  EFM_ASSERT((bytes > 0) && (bytes <= SPI_PACKED_BYTES));
+
+  transaction.readTrue = readTrue;
+  transaction.registerAddress = registerAddress;
+  transaction.txBuf = NULL;
+  transaction.rxBuf = NULL;
+  transaction.bytes = bytes;
+  transaction.callback = callback;
+  transaction.storeData = readTrue ? storeData : NULL;
+  transaction.packedTrue = true;
+  for(uint32_t i = 0; i < bytes; i++){
+      transaction.packBytes[i] = (write_data >> (EIGHT*(bytes - 1 - i))) & MASK;
+  }
+
+  spi_enqueue(usart, &transaction);
+}
+
+/***************************************************************************//**
+ * @brief
+ *  This function queues a read or write of a buffer
+ *
+ * @details
+ *  spi_transfer() adds the transfer to the driver's queue and returns right
+ *  away, so the caller can go back to sleep while the bus is busy. All of the
+ *  bytes go out in one chip select window, so a whole block of registers can
+ *  be read with one transfer.
+ *
+ * @note
+ *  This function must be called after spi_open. The buffers belong to the
+ *  caller and must not be touched until the callback has been scheduled.
+ *
+ * @param [in] usart
+ *  Defines the USART peripheral that is being used
+ *
+ * @param [in] readTrue
+ *  Indicates whether the state machine should be reading or writing. If the
+ *  variable is true, the a read must be done.
+ *
+ * @param [in] registerAddress
+ *  Indicates the register address to be read or written to
+ *
+ * @param [in] txBuf
+ *  Bytes to be written, not used for a read
+ *
+ * @param [in] rxBuf
+ *  Buffer that the bytes read are stored in, not used for a write
+ *
+ * @param [in] bytes
+ *  Defines the number of bytes being read or written
+ *
+ * @param [in] callback
+ *  Specifies the callback that is added to the scheduler after the state machine
+ *  is complete
+ *
+ ******************************************************************************/
+void spi_transfer(USART_TypeDef *usart, bool readTrue, uint32_t registerAddress,
+                  const uint8_t *txBuf, uint8_t *rxBuf, uint32_t bytes,
+                  uint32_t callback){
+  SPI_TRANSACTION transaction;
+
+  EFM_ASSERT(bytes > 0);
+  EFM_ASSERT(readTrue ? (rxBuf != NULL) : (txBuf != NULL));
+
+  transaction.readTrue = readTrue;
+  transaction.registerAddress = registerAddress;
+  transaction.txBuf = txBuf;
+  transaction.rxBuf = rxBuf;
+  transaction.bytes = bytes;
+  transaction.callback = callback;
+  transaction.storeData = NULL;
+  transaction.packedTrue = false;
+
+  spi_enqueue(usart, &transaction);
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Returns the number of transfers in the queue
+ *
+ * @details
+ *  The count includes the transfer that is on the bus, so 0 means the driver
+ *  is idle
+ *
+ * @param [in] usart
+ *  Defines the USART peripheral that is being used
+ *
+ ******************************************************************************/
+uint32_t spi_queue_depth(USART_TypeDef *usart){
+  return usart_state_struct[spi_instance(usart)].queueCount;
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Returns true while a transfer, a polled frame or a stream owns the driver
+ *
+ * @details
+ *  A callback posted while this is false cannot overtake a transfer, since
+ *  nothing started earlier is still waiting for its own callback.
+ *
+ * @param [in] usart
+ *  Defines the USART peripheral that is being used
+ *
+ ******************************************************************************/
+bool spi_get_busy(USART_TypeDef *usart){
+  return usart_state_struct[spi_instance(usart)].busy;
+}
 
-  while(usart_state_struct.busy);
+/***************************************************************************//**
+ * @brief
+ *  Returns the most transfers that have been in the queue at once
+ *
+ * @details
+ *  Used to tune SPI_QUEUE_DEPTH. If the high water mark reaches
+ *  SPI_QUEUE_DEPTH transfers are being added faster than the bus moves them.
+ *
+ * @param [in] usart
+ *  Defines the USART peripheral that is being used
+ *
+ ******************************************************************************/
+uint32_t spi_queue_high_water(USART_TypeDef *usart){
+  return usart_state_struct[spi_instance(usart)].queueHighWater;
+}
 
-//  CORE_DECLARE_IRQ_STATE;
-//  CORE_ENTER_CRITICAL();
+/***************************************************************************//**
+ * @brief
+ *  Starts reading a register block each time a PRS channel fires
+ *
+ * @details
+ *  spi_stream_start() hands the USART to the LDMA for autonomous sampling. The
+ *  TX channel waits on an LDMA sync bit set by the rising edge of PRS channel
+ *  prs_ch, sends the read header and bytes of GARBAGEDATA, and loops back to
+ *  wait again. The RX channel writes every frame, address echo first, into
+ *  ring and swaps between its two halves, raising the only interrupt when a
+ *  half of samples frames is full. The CPU is never woken to start a read.
+ *
+ *  Hardware chip select is required since no code runs between frames to move
+ *  the GPIO, and the LDMA and USART need the HF clock so EM2 stays blocked
+ *  while streaming. Transfers queued while streaming wait until
+ *  spi_stream_stop().
+ *
+ * @note
+ *  The source of prs_ch is set up by its owner, e.g. letimer_prs_open()
+ *
+ * @param [in] usart
+ *  Defines the USART peripheral that is being used
+ *
+ * @param [in] prs_ch
+ *  PRS channel that triggers a sample, 0 to 7
+ *
+ * @param [in] registerAddress
+ *  First register read in every sample
+ *
+ * @param [in] bytes
+ *  Registers read in every sample
+ *
+ * @param [in] ring
+ *  Buffer of 2 * samples * SPI_STREAM_FRAME(bytes) bytes
+ *
+ * @param [in] samples
+ *  Frames in each half of ring, so samples between callbacks
+ *
+ * @param [in] callback
+ *  Scheduler event posted every time a half of ring is full
+ *
+ ******************************************************************************/
+void spi_stream_start(USART_TypeDef *usart, uint32_t prs_ch, uint32_t registerAddress,
+    uint32_t bytes, uint8_t *ring, uint32_t samples, uint32_t callback){
+  SPI_STATE_MACHINE *spi_sm = &usart_state_struct[spi_instance(usart)];
+  LDMA_TransferCfg_t tx_cfg = LDMA_TRANSFER_CFG_PERIPHERAL(spi_sm->ldmaTxSignal);
+  LDMA_TransferCfg_t rx_cfg = LDMA_TRANSFER_CFG_PERIPHERAL(spi_sm->ldmaRxSignal);
+  LDMA_Descriptor_t tx_wait = LDMA_DESCRIPTOR_LINKREL_SYNC(0, 1 << prs_ch,
+      1 << prs_ch, 1 << prs_ch, 1);
+  LDMA_Descriptor_t tx_head = LDMA_DESCRIPTOR_LINKREL_M2P_BYTE(&spi_sm->header,
+      &usart->TXDATA, 1, 1);
+  LDMA_Descriptor_t tx_data = LDMA_DESCRIPTOR_LINKREL_M2P_BYTE(&spi_sm->txDummy,
+      &usart->TXDATA, bytes, -2);
+  LDMA_Descriptor_t rx_first = LDMA_DESCRIPTOR_LINKREL_P2M_BYTE(&usart->RXDATA,
+      ring, samples * SPI_STREAM_FRAME(bytes), 1);
+  LDMA_Descriptor_t rx_second = LDMA_DESCRIPTOR_LINKREL_P2M_BYTE(&usart->RXDATA,
+      ring + samples * SPI_STREAM_FRAME(bytes), samples * SPI_STREAM_FRAME(bytes), -1);
 
-  usart_state_struct.usart = usart;
-  usart_state_struct.readTrue = readTrue;
-  usart_state_struct.registerAddress = registerAddress;
-  usart_state_struct.callback = callback;
-  usart_state_struct.storeData = storeData;
-  usart_state_struct.writeData = write_data;
-  usart_state_struct.bitBucketTrue = true;
-  usart_state_struct.readCounter = bytes;
-  usart_state_struct.writeCounter = bytes;
-  *(usart_state_struct.storeData) = 0;
+  EFM_ASSERT(spi_sm->ldmaTrue && spi_sm->autoCsTrue);
+  EFM_ASSERT(prs_ch < LDMA_NUM_SYNC);
+  EFM_ASSERT(samples * SPI_STREAM_FRAME(bytes) <= SPI_LDMA_MAX_BYTES);
 
+  CORE_DECLARE_IRQ_STATE;
+  CORE_ENTER_CRITICAL();
+  EFM_ASSERT(!spi_sm->busy);
   sleep_block_mode(SPI_SLEEP_BLOCK);
-  usart_state_struct.busy = true;
-  GPIO_PinOutClear(USART_CS_PORT, USART_CS_PIN);
-  usart_state_struct.currentState = sendRA;
+  spi_sm->busy = true;
+  spi_sm->streamTrue = true;
+  CORE_EXIT_CRITICAL();
 
-  //usart->CMD = USART_CMD_CLEARRX;
-  usart->IEN |= USART_IEN_TXBL | USART_IEN_RXDATAV;
+  spi_sm->streamRing = ring;
+  spi_sm->streamHalfBytes = samples * SPI_STREAM_FRAME(bytes);
+  spi_sm->streamNext = 0;
+  spi_sm->streamCallback = callback;
+  spi_sm->header = registerAddress | (READBIT << SHIFTBY7);
+  spi_sm->txDummy = GARBAGEDATA;
 
-//  CORE_EXIT_CRITICAL();
+  tx_data.xfer.srcInc = ldmaCtrlSrcIncNone;
+  tx_wait.sync.doneIfs = false;
+  tx_head.xfer.doneIfs = false;
+  tx_data.xfer.doneIfs = false;
+  rx_first.xfer.doneIfs = true;
+  rx_second.xfer.doneIfs = true;
 
+  spi_sm->streamTxDesc[0] = tx_wait;
+  spi_sm->streamTxDesc[1] = tx_head;
+  spi_sm->streamTxDesc[2] = tx_data;
+  spi_sm->streamRxDesc[0] = rx_first;
+  spi_sm->streamRxDesc[1] = rx_second;
+
+  usart->CLKDIV = spi_sm->clkdivRead;
+  usart->CMD = USART_CMD_CLEARRX;
+  ldma_sync_prs_enable(prs_ch);
+  LDMA_StartTransfer(spi_sm->ldmaRxCh, &rx_cfg, &spi_sm->streamRxDesc[0]);
+  LDMA_StartTransfer(spi_sm->ldmaTxCh, &tx_cfg, &spi_sm->streamTxDesc[0]);
 }
 
 /***************************************************************************//**
  * @brief
- *  Interrupt handler for the RX USART interrupts
+ *  Stops PRS triggered sampling
  *
  * @details
- *  This function checks if the RXDATAV interrupts has been triggered and enters
- *  the usart_rxdatav_sm function if so.
+ *  spi_stream_stop() stops both LDMA channels and gives the USART back to the
+ *  queue. A transfer that was queued while streaming is started right away,
+ *  otherwise the sleep mode is unblocked.
  *
  * @note
- *  the RXDATAV interrupt is enabled in spi_start()
+ *  A frame that is in flight when this is called is cut short
+ *
+ * @param [in] usart
+ *  Defines the USART peripheral that is being used
  *
  ******************************************************************************/
-void USART3_RX_IRQHandler(void){
+void spi_stream_stop(USART_TypeDef *usart){
+  SPI_STATE_MACHINE *spi_sm = &usart_state_struct[spi_instance(usart)];
+
+  CORE_DECLARE_IRQ_STATE;
+  CORE_ENTER_CRITICAL();
+  if(spi_sm->streamTrue){
+      LDMA_StopTransfer(spi_sm->ldmaTxCh);
+      LDMA_StopTransfer(spi_sm->ldmaRxCh);
+      spi_sm->streamTrue = false;
+      if(spi_sm->queueCount){
+          spi_begin(spi_sm);
+      } else {
+          sleep_unblock_mode(SPI_SLEEP_BLOCK);
+          spi_sm->busy = false;
+      }
+  }
+  CORE_EXIT_CRITICAL();
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Returns the half of the stream ring that was filled last
+ *
+ * @details
+ *  Called from the stream callback. The frames are SPI_STREAM_FRAME(bytes)
+ *  apart and the data of each starts at its second byte. The half stays
+ *  untouched until the LDMA has filled the other one.
+ *
+ * @param [in] usart
+ *  Defines the USART peripheral that is being used
+ *
+ ******************************************************************************/
+const uint8_t *spi_stream_frames(USART_TypeDef *usart){
+  SPI_STATE_MACHINE *spi_sm = &usart_state_struct[spi_instance(usart)];
+
+  return spi_sm->streamRing + ((spi_sm->streamNext ^ 1) * spi_sm->streamHalfBytes);
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Copies out the timing statistics of one register address
+ *
+ * @details
+ *  spi_stats_read() copies the statistics inside a critical section so a
+ *  transfer finishing in an ISR cannot tear the copy. All times are in core
+ *  clock cycles, the mean of any of the sums is the sum divided by count.
+ *
+ * @note
+ *  Statistics are only kept when SPI_STATS_ENABLE is set, otherwise this
+ *  returns false and the struct is left alone
+ *
+ * @param [in] registerAddress
+ *  Register address the transfers were made to
+ *
+ * @param [out] stats
+ *  Where the statistics are copied to
+ *
+ * @return
+ *  True if at least one transfer to the register has been timed
+ *
+ ******************************************************************************/
+bool spi_stats_read(uint32_t registerAddress, SPI_REG_STATS *stats){
+#if SPI_STATS_ENABLE
+  bool found;
+
+  CORE_DECLARE_IRQ_STATE;
+  CORE_ENTER_CRITICAL();
+  *stats = spi_stats[registerAddress % SPI_STATS_REGISTERS];
+  CORE_EXIT_CRITICAL();
+
+  found = (stats->count != 0);
+  return found;
+#else
+  (void)registerAddress;
+  (void)stats;
+  return false;
+#endif
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Clears the timing statistics of every register address
+ *
+ ******************************************************************************/
+void spi_stats_reset(void){
+#if SPI_STATS_ENABLE
+  CORE_DECLARE_IRQ_STATE;
+  CORE_ENTER_CRITICAL();
+  for(uint32_t i = 0; i < SPI_STATS_REGISTERS; i++){
+      spi_stats[i] = (SPI_REG_STATS){0};
+  }
+  CORE_EXIT_CRITICAL();
+#endif
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Shared body of the RX USART interrupt handlers
+ *
+ * @details
+ *  This function checks if the RXFULL or RXDATAV interrupts has been triggered
+ *  and enters the usart_rxfull_sm or usart_rxdatav_sm function.
+ *
+ * @note
+ *  the RXDATAV or RXFULL interrupt is enabled in spi_begin()
+ *
+ * @param [in] spi_sm
+ *  SPI_STATE_MACHINE *spi_sm of the USART that raised the interrupt
+ *
+ ******************************************************************************/
+void usart_rx_irq(SPI_STATE_MACHINE *spi_sm){
   uint32_t int_flag;
-  int_flag = USART3->IF & USART3->IEN;
-  //USART3->IFC = int_flag;
+  SPI_ISR_ENTER(spi_sm);
+  int_flag = spi_sm->usart->IF & spi_sm->usart->IEN;
+  //spi_sm->usart->IFC = int_flag;
 
-  if(int_flag & USART_IF_RXDATAV){
-      usart_rxdatav_sm(&usart_state_struct);
+  if(int_flag & USART_IF_RXFULL){
+      spi_sm->usart->IFC = USART_IF_RXFULL;
+      usart_rxfull_sm(spi_sm);
+  } else if(int_flag & USART_IF_RXDATAV){
+      usart_rxdatav_sm(spi_sm);
   }
+  SPI_ISR_EXIT(spi_sm);
 }
 
 /***************************************************************************//**
@@ -207,7 +1199,7 @@ void USART3_RX_IRQHandler(void){
  * @details
  *  RXDATAV is triggered went data is in the recieve buffer. This function is
  *  called after the interrupt is triggered and is used to read data out of the
- *  RX buffer. If it is performing a read, the the data is stored but if if is
+ *  RX buffer. If it is performing a read, the the data is stored in rxBuf but if if is
  *  a write, the data is written to a local variable that is discarded at the end
  *  of the function. After all the data has been read, the RXDATAV interrupt is
  *  disabled and the state machine is ended. After all the data
@@ -231,20 +1223,7 @@ void usart_rxdatav_sm(SPI_STATE_MACHINE *spi_sm){
       break;
 
     case read:
-      if(spi_sm->bitBucketTrue) {
-          spi_sm->bitBucketTrue = false;
-      } else {
-        spi_sm->readCounter--;
-        *(spi_sm->storeData) = ((bitBucket)<<(EIGHT*spi_sm->readCounter))|*(spi_sm->storeData);
-        if(spi_sm->readCounter == 0){
-            //spi_sm->usart->IEN &= ~USART_IEN_RXDATAV;
-            spi_sm->usart->IFC = USART_IEN_TXC;
-            sleep_unblock_mode(SPI_SLEEP_BLOCK);
-            spi_sm->busy = false;
-            GPIO_PinOutSet(USART_CS_PORT, USART_CS_PIN);
-            add_scheduled_event(spi_sm->callback);
-        }
-      }
+      spi_rx_byte(spi_sm, bitBucket);
       break;
 
     case write:
@@ -263,7 +1242,51 @@ void usart_rxdatav_sm(SPI_STATE_MACHINE *spi_sm){
 
 /***************************************************************************//**
  * @brief
- *  Interrupt handler for the TX USART interrupts
+ *  the RXFULL state machine function
+ *
+ * @details
+ *  RXFULL is triggered when both receive buffer slots hold data, which is only
+ *  enabled for a read in double buffered mode. Both bytes are taken out with one
+ *  read of RXDOUBLE. When a frame has an odd number of bytes, RXFULL is swapped
+ *  for RXDATAV before the last byte so usart_rxdatav_sm() can take it.
+ *
+ * @param [in] spi_sm
+ *  SPI_STATE_MACHINE *spi_sm which holds variables needed to use the state
+ *  machine
+ ******************************************************************************/
+void usart_rxfull_sm(SPI_STATE_MACHINE *spi_sm){
+  uint32_t bitBucket;
+  uint32_t remaining;
+  bitBucket = spi_sm->usart->RXDOUBLE;
+
+  switch (spi_sm->currentState) {
+    case sendRA:
+      EFM_ASSERT(false);
+      break;
+
+    case read:
+      remaining = spi_sm->readCounter + spi_sm->bitBucketTrue - 2;
+      if(remaining == 1){
+          spi_sm->usart->IEN &= ~USART_IEN_RXFULL;
+          spi_sm->usart->IEN |= USART_IEN_RXDATAV;
+      }
+      spi_rx_byte(spi_sm, bitBucket & MASK);
+      spi_rx_byte(spi_sm, (bitBucket >> EIGHT) & MASK);
+      break;
+
+    case write:
+      EFM_ASSERT(false);
+      break;
+
+    default:
+      EFM_ASSERT(false);
+      break;
+  }
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Shared body of the TX USART interrupt handlers
  *
  * @details
  *  This function checks if the TXBL and TXC interrupts has been triggered, then
@@ -273,21 +1296,26 @@ void usart_rxdatav_sm(SPI_STATE_MACHINE *spi_sm){
  *  the txbl interrupt is enabled in spi_start() and txc interrupt is enabled
  *  after all data has been written
  *
+ * @param [in] spi_sm
+ *  SPI_STATE_MACHINE *spi_sm of the USART that raised the interrupt
+ *
  ******************************************************************************/
-void USART3_TX_IRQHandler(void){
+void usart_tx_irq(SPI_STATE_MACHINE *spi_sm){
   uint32_t int_flag;
-  int_flag = USART3->IF & USART3->IEN;
-  USART3->IFC = int_flag;
+  SPI_ISR_ENTER(spi_sm);
+  int_flag = spi_sm->usart->IF & spi_sm->usart->IEN;
+  spi_sm->usart->IFC = int_flag;
 
   if(int_flag & USART_IF_TXBL){
-    //EFM_ASSERT(!(USART0->IF & USART_IF_TXBL));
-    usart_txbl_sm(&usart_state_struct);
+    //EFM_ASSERT(!(spi_sm->usart->IF & USART_IF_TXBL));
+    usart_txbl_sm(spi_sm);
   }
 
   if(int_flag & USART_IF_TXC){
-    EFM_ASSERT(!(USART3->IF & USART_IF_TXC));
-    usart_txc_sm(&usart_state_struct);
+    EFM_ASSERT(!(spi_sm->usart->IF & USART_IF_TXC));
+    usart_txc_sm(spi_sm);
   }
+  SPI_ISR_EXIT(spi_sm);
 }
 
 /***************************************************************************//**
@@ -296,7 +1324,9 @@ void USART3_TX_IRQHandler(void){
  *
  * @details
  *  This function is triggered by the TXBL interrupt and is used to transmit data
- *  with the SPI peripheral.
+ *  with the SPI peripheral. In double buffered mode the register address and
+ *  the first data byte are sent together and data is then sent two bytes at a
+ *  time.
  *
  * @note
  *  The TXBL interrupt can only be disabled in this function and not the rxdatav
@@ -308,34 +1338,38 @@ void USART3_TX_IRQHandler(void){
  *
  ******************************************************************************/
 void usart_txbl_sm(SPI_STATE_MACHINE *spi_sm){
+  uint32_t header;
+
   switch (spi_sm->currentState) {
     case sendRA:
+      SPI_STAMP(spi_sm->stamps.firstByte);
       if(spi_sm->readTrue) {
-          spi_sm->usart->TXDATA = (spi_sm->registerAddress) | (READBIT << SHIFTBY7);
+          header = (spi_sm->registerAddress) | (READBIT << SHIFTBY7);
           spi_sm->currentState = read;
       } else {
-          spi_sm->usart->TXDATA = (spi_sm->registerAddress) | (WRITEBIT << SHIFTBY7);
+          header = (spi_sm->registerAddress) | (WRITEBIT << SHIFTBY7);
           spi_sm->currentState = write;
       }
+      if(spi_sm->doubleTrue) {
+          //the first data byte goes out with the address
+          spi_sm->usart->TXDOUBLE = header | (spi_tx_byte(spi_sm) << EIGHT);
+          if(spi_sm->writeCounter == 0) {
+              spi_sm->usart->IEN &= ~USART_IEN_TXBL;
+              spi_sm->usart->IEN |= USART_IEN_TXC * !spi_sm->readTrue;
+          }
+      } else {
+          spi_sm->usart->TXDATA = header;
+      }
       break;
 
     case read:
-      spi_sm->usart->TXDATA = GARBAGEDATA;
       //disable txbl once all data has been read
-      spi_sm->writeCounter--;
-      if((spi_sm->writeCounter) == 0) {
-          spi_sm->usart->IEN &= ~USART_IF_TXBL;
-      }
+      spi_tx_data(spi_sm);
       break;
 
     case write:
-      spi_sm->writeCounter--;
-      spi_sm->usart->TXDATA = (spi_sm->writeData>>(EIGHT*spi_sm->writeCounter)) & MASK;
       //disable txbl and enable txc when everything has been written
-      if(spi_sm->writeCounter == 0) {
-         spi_sm->usart->IEN &= ~USART_IEN_TXBL;
-         spi_sm->usart->IEN |= USART_IEN_TXC;
-      }
+      spi_tx_data(spi_sm);
       break;
 
     default:
@@ -370,11 +1404,8 @@ void usart_txc_sm(SPI_STATE_MACHINE *spi_sm){
       break;
 
     case write:
-      sleep_unblock_mode(SPI_SLEEP_BLOCK);
-      spi_sm->busy = false;
-      GPIO_PinOutSet(USART_CS_PORT, USART_CS_PIN);
-      add_scheduled_event(spi_sm->callback);
       spi_sm->usart->IEN &= ~USART_IF_TXC;
+      spi_done(spi_sm);
       break;
 
     default:
@@ -383,3 +1414,96 @@ void usart_txc_sm(SPI_STATE_MACHINE *spi_sm){
 
   }
 }
+
+/***************************************************************************//**
+ * @brief
+ *  the function called by the LDMA interrupt when an LDMA frame is done
+ *
+ * @details
+ *  This function is called once the RX channel has received the last byte of
+ *  the frame, which also means the last byte has been sent, and ends the
+ *  transfer with spi_done(). While streaming it is instead called each time a
+ *  half of the ring fills, and posts the stream callback.
+ *
+ * @note
+ *  Registered with ldma_channel_open() in spi_open() when ldma_en is set
+ *
+ * @param [in] context
+ *  SPI_STATE_MACHINE *spi_sm which holds variables needed to use the state
+ *  machine
+ *
+ ******************************************************************************/
+void usart_ldma_done_sm(void *context){
+  SPI_STATE_MACHINE *spi_sm = context;
+
+  if(spi_sm->streamTrue){
+      spi_sm->streamNext ^= 1;
+      add_scheduled_event(spi_sm->streamCallback);
+  } else {
+      spi_done(spi_sm);
+  }
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Interrupt handlers for each USART
+ *
+ * @details
+ *  Each handler passes its own state machine to usart_rx_irq() or
+ *  usart_tx_irq(), so no handler has to work out which USART it belongs to.
+ *
+ ******************************************************************************/
+#if defined(USART0)
+void USART0_RX_IRQHandler(void){
+  usart_rx_irq(&usart_state_struct[0]);
+}
+
+void USART0_TX_IRQHandler(void){
+  usart_tx_irq(&usart_state_struct[0]);
+}
+#endif
+#if defined(USART1)
+void USART1_RX_IRQHandler(void){
+  usart_rx_irq(&usart_state_struct[1]);
+}
+
+void USART1_TX_IRQHandler(void){
+  usart_tx_irq(&usart_state_struct[1]);
+}
+#endif
+#if defined(USART2)
+void USART2_RX_IRQHandler(void){
+  usart_rx_irq(&usart_state_struct[2]);
+}
+
+void USART2_TX_IRQHandler(void){
+  usart_tx_irq(&usart_state_struct[2]);
+}
+#endif
+#if defined(USART3)
+void USART3_RX_IRQHandler(void){
+  usart_rx_irq(&usart_state_struct[3]);
+}
+
+void USART3_TX_IRQHandler(void){
+  usart_tx_irq(&usart_state_struct[3]);
+}
+#endif
+#if defined(USART4)
+void USART4_RX_IRQHandler(void){
+  usart_rx_irq(&usart_state_struct[4]);
+}
+
+void USART4_TX_IRQHandler(void){
+  usart_tx_irq(&usart_state_struct[4]);
+}
+#endif
+#if defined(USART5)
+void USART5_RX_IRQHandler(void){
+  usart_rx_irq(&usart_state_struct[5]);
+}
+
+void USART5_TX_IRQHandler(void){
+  usart_tx_irq(&usart_state_struct[5]);
+}
+#endif
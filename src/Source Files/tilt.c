@@ -0,0 +1,248 @@
+/**
+ * @file   tilt.c
+ * @brief  Fixed point pitch, roll and face up / face down from the accelerometer
+ *
+ */
+//***********************************************************************************
+// Include files
+//***********************************************************************************
+#include "tilt.h"
+
+//***********************************************************************************
+// private define statements
+//***********************************************************************************
+
+//***********************************************************************************
+// private variables
+//***********************************************************************************
+//atan(2^-i) as a binary angle, 65536 is a full turn
+static const int16_t tilt_atan_table[TILT_CORDIC_STEPS] = {
+    8192, 4836, 2555, 1297, 651, 326, 163, 81, 41, 20, 10, 5, 3, 1, 1
+};
+
+//***********************************************************************************
+// private function prototypes
+//***********************************************************************************
+static int16_t tilt_fuse(int16_t estimate, int32_t accel_angle, int32_t rate,
+    const TILT_STATE *tilt);
+
+//***********************************************************************************
+// private functions
+//***********************************************************************************
+/***************************************************************************//**
+ * @brief
+ *  One step of the complementary filter
+ *
+ * @details
+ *  The estimate is moved by the gyro rate and then pulled towards the
+ *  accelerometer angle by accelWeight. The difference is taken as an int16_t
+ *  so the filter takes the short way around at +/-180 degrees.
+ *
+ ******************************************************************************/
+static int16_t tilt_fuse(int16_t estimate, int32_t accel_angle, int32_t rate,
+    const TILT_STATE *tilt){
+  int32_t angle;
+  int16_t error;
+
+  angle = estimate + (int32_t)(((int64_t)rate * tilt->gyroGain) >> TILT_GYRO_GAIN_SHIFT);
+  error = (int16_t)(accel_angle - angle);
+  angle += (error * tilt->accelWeight) >> 15;
+
+  return (int16_t)angle;
+}
+
+//***********************************************************************************
+// global functions
+//***********************************************************************************
+/***************************************************************************//**
+ * @brief
+ *  Sets up a tilt state
+ *
+ * @details
+ *  The board is face down once its Z axis is more than 90 + hysteresis_deg
+ *  degrees from up and face up again once it is less than 90 - hysteresis_deg
+ *  degrees from up, so a board held on its edge does not flip between the two.
+ *  The gyro is off until tilt_gyro_open() is called.
+ *
+ * @param [in] tilt
+ *  Tilt state to set up
+ *
+ * @param [in] hysteresis_deg
+ *  Half the width of the band around 90 degrees where the state is kept
+ *
+ ******************************************************************************/
+void tilt_open(TILT_STATE *tilt, uint32_t hysteresis_deg){
+  EFM_ASSERT(hysteresis_deg < 90);
+
+  tilt->pitch = 0;
+  tilt->roll = 0;
+  tilt->tilt = 0;
+  tilt->orientation = TILT_UNKNOWN;
+  tilt->faceDownAbove = TILT_QUARTER_TURN + TILT_DEG_TO_ANGLE(hysteresis_deg);
+  tilt->faceUpBelow = TILT_QUARTER_TURN - TILT_DEG_TO_ANGLE(hysteresis_deg);
+  tilt->gyroTrue = false;
+  tilt->gyroGain = 0;
+  tilt->accelWeight = TILT_Q15_ONE;
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Lets tilt_update() filter pitch and roll with the gyro
+ *
+ * @details
+ *  The division that turns gyro counts into an angle per sample is done here,
+ *  once, so tilt_update() only multiplies and shifts.
+ *
+ * @param [in] tilt
+ *  Tilt state from tilt_open()
+ *
+ * @param [in] lsb_per_dps
+ *  Gyro counts per degree per second, 131 for the +/-250 dps range
+ *
+ * @param [in] odr_hz
+ *  Rate tilt_update() is called at
+ *
+ * @param [in] accel_weight
+ *  Q15 weight of the accelerometer angle, 1024 is 1/32
+ *
+ ******************************************************************************/
+void tilt_gyro_open(TILT_STATE *tilt, uint32_t lsb_per_dps, uint32_t odr_hz,
+    int32_t accel_weight){
+  EFM_ASSERT(lsb_per_dps && odr_hz);
+  EFM_ASSERT(accel_weight > 0 && accel_weight <= TILT_Q15_ONE);
+
+  tilt->gyroGain = (int32_t)(((int64_t)65536 << TILT_GYRO_GAIN_SHIFT)
+      / ((int64_t)360 * lsb_per_dps * odr_hz));
+  tilt->accelWeight = accel_weight;
+  tilt->gyroTrue = true;
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Goes back to pitch and roll from the accelerometer only
+ *
+ ******************************************************************************/
+void tilt_gyro_close(TILT_STATE *tilt){
+  tilt->gyroTrue = false;
+  tilt->accelWeight = TILT_Q15_ONE;
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Updates the tilt state from one sample
+ *
+ * @details
+ *  Roll is atan2(Y, Z) and pitch is atan2(-X, |Y Z|), so all three axes are
+ *  used and neither angle falls apart when the other one is large. The face
+ *  up / face down state comes from the angle between Z and the whole vector,
+ *  which is the same as the old Z sign check but with the hysteresis band of
+ *  tilt_open(). Roll follows gyro X and pitch follows gyro Y when the gyro is
+ *  on.
+ *
+ * @note
+ *  There is no floating point or division in this function, only shifts,
+ *  adds and multiplies, so it costs about the same in every energy mode.
+ *
+ * @param [in] tilt
+ *  Tilt state from tilt_open()
+ *
+ * @param [in] accel
+ *  Accelerometer X, Y, Z in counts
+ *
+ * @param [in] gyro
+ *  Gyro X, Y, Z in counts, or NULL when the gyro is off
+ *
+ * @return
+ *  true when the face up / face down state changed, including the first sample
+ *
+ ******************************************************************************/
+bool tilt_update(TILT_STATE *tilt, const int16_t accel[3], const int16_t *gyro){
+  int32_t yz;
+  int32_t xy;
+  int32_t roll;
+  int32_t pitch;
+  TILT_ORIENTATION orientation;
+
+  roll = tilt_atan2(accel[1], accel[2], &yz);
+  pitch = tilt_atan2(-accel[0], yz, NULL);
+  tilt_atan2(accel[1], accel[0], &xy);
+  tilt->tilt = (uint16_t)tilt_atan2(xy, accel[2], NULL);
+
+  if(tilt->gyroTrue && gyro && tilt->orientation != TILT_UNKNOWN){
+      tilt->roll = tilt_fuse(tilt->roll, roll, gyro[0], tilt);
+      tilt->pitch = tilt_fuse(tilt->pitch, pitch, gyro[1], tilt);
+  } else {
+      tilt->roll = (int16_t)roll;
+      tilt->pitch = (int16_t)pitch;
+  }
+
+  orientation = tilt->orientation;
+  if(tilt->tilt > tilt->faceDownAbove){
+      orientation = TILT_FACE_DOWN;
+  } else if(tilt->tilt < tilt->faceUpBelow){
+      orientation = TILT_FACE_UP;
+  } else if(orientation == TILT_UNKNOWN){
+      orientation = (tilt->tilt > TILT_QUARTER_TURN) ? TILT_FACE_DOWN : TILT_FACE_UP;
+  }
+
+  if(orientation != tilt->orientation){
+      tilt->orientation = orientation;
+      return true;
+  }
+  return false;
+}
+
+/***************************************************************************//**
+ * @brief
+ *  Integer atan2 and vector length
+ *
+ * @details
+ *  A vectoring CORDIC turns (x, y) onto the x axis with TILT_CORDIC_STEPS
+ *  shift and add steps and adds up the angle it turned by. The left half
+ *  plane is first turned by half a turn so the steps always converge. The
+ *  length the CORDIC leaves in x is scaled back by TILT_CORDIC_GAIN_INV.
+ *
+ * @param [in] y
+ *  y of the vector, within +/-2^17
+ *
+ * @param [in] x
+ *  x of the vector, within +/-2^17
+ *
+ * @param [out] magnitude
+ *  Length of the vector in the units of x and y, or NULL if not needed
+ *
+ * @return
+ *  Binary angle from -32768 to 32768, 65536 is a full turn
+ *
+ ******************************************************************************/
+int32_t tilt_atan2(int32_t y, int32_t x, int32_t *magnitude){
+  int32_t angle = 0;
+  int32_t x_next;
+
+  x <<= TILT_CORDIC_SHIFT;
+  y <<= TILT_CORDIC_SHIFT;
+  if(x < 0){
+      angle = (y < 0) ? -TILT_HALF_TURN : TILT_HALF_TURN;
+      x = -x;
+      y = -y;
+  }
+
+  for(int i = 0; i < TILT_CORDIC_STEPS; i++){
+      if(y > 0){
+          x_next = x + (y >> i);
+          y = y - (x >> i);
+          angle += tilt_atan_table[i];
+      } else {
+          x_next = x - (y >> i);
+          y = y + (x >> i);
+          angle -= tilt_atan_table[i];
+      }
+      x = x_next;
+  }
+
+  if(magnitude){
+      *magnitude = (int32_t)(((int64_t)x * TILT_CORDIC_GAIN_INV)
+          >> (15 + TILT_CORDIC_SHIFT));
+  }
+  return angle;
+}
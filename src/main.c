@@ -82,9 +82,81 @@ int main(void)
           //scheduled_ble_tx_done_cb();
       }
 
+      if(get_scheduled_events() & ICM20648_INIT_CB){
+          remove_scheduled_event(ICM20648_INIT_CB);
+          icm20648_init_step();
+      }
+
+      if(get_scheduled_events() & ICM20648_READY_CB){
+          remove_scheduled_event(ICM20648_READY_CB);
+          scheduled_icm20648_ready_cb();
+      }
+
       if(get_scheduled_events() & ICM20648_READ_CB){
           remove_scheduled_event(ICM20648_READ_CB);
           scheduled_icm20648_read_cb();
       }
+
+      if(get_scheduled_events() & ICM20648_STREAM_CB){
+          remove_scheduled_event(ICM20648_STREAM_CB);
+          scheduled_icm20648_stream_cb();
+      }
+
+      if(get_scheduled_events() & ICM20648_MOTION_CB){
+          remove_scheduled_event(ICM20648_MOTION_CB);
+          scheduled_icm20648_motion_cb();
+      }
+
+      if(get_scheduled_events() & ICM20648_DRDY_CB){
+          remove_scheduled_event(ICM20648_DRDY_CB);
+          scheduled_icm20648_drdy_cb();
+      }
+
+      if(get_scheduled_events() & ICM20648_SAMPLE_CB){
+          remove_scheduled_event(ICM20648_SAMPLE_CB);
+          scheduled_icm20648_sample_cb();
+      }
+
+      if(get_scheduled_events() & ICM20648_FIFO_COUNT_CB){
+          remove_scheduled_event(ICM20648_FIFO_COUNT_CB);
+          scheduled_icm20648_fifo_count_cb();
+      }
+
+      if(get_scheduled_events() & ICM20648_FIFO_DRAIN_CB){
+          remove_scheduled_event(ICM20648_FIFO_DRAIN_CB);
+          scheduled_icm20648_fifo_drain_cb();
+      }
+
+      if(get_scheduled_events() & GESTURE_TAP_CB){
+          remove_scheduled_event(GESTURE_TAP_CB);
+          scheduled_gesture_tap_cb();
+      }
+
+      if(get_scheduled_events() & GESTURE_STEP_CB){
+          remove_scheduled_event(GESTURE_STEP_CB);
+          scheduled_gesture_step_cb();
+      }
+
+      if(get_scheduled_events() & GESTURE_SHAKE_CB){
+          remove_scheduled_event(GESTURE_SHAKE_CB);
+          scheduled_gesture_shake_cb();
+      }
+
+      if(get_scheduled_events() & POWER_MODE_CB){
+          remove_scheduled_event(POWER_MODE_CB);
+          scheduled_power_mode_cb();
+      }
+      if(get_scheduled_events() & SI1133_ERROR_CB){
+          remove_scheduled_event(SI1133_ERROR_CB);
+          scheduled_si1133_error_cb();
+      }
+      if(get_scheduled_events() & SI1133_RECOVER_CB){
+          remove_scheduled_event(SI1133_RECOVER_CB);
+          scheduled_si1133_recover_cb();
+      }
+      if(get_scheduled_events() & ICM20648_ERROR_CB){
+          remove_scheduled_event(ICM20648_ERROR_CB);
+          scheduled_icm20648_error_cb();
+      }
   }
 }